@@ -51,12 +51,13 @@ void ang_dist_glove_subset()
         H5::Group *grp = new H5::Group(file->createGroup(ss.str()));
         puffinn::PQFilter filter(train, m, 256);
         filter.rebuild();
+        std::vector<int16_t> query_distances(filter.getLookupTableSize());
 
         // calculate asymmetric distance
         for (int j = 0; j < test_dim.first; j++) {
-            filter.precomp_query_to_centroids(test[j]);
+            filter.precomp_query_to_centroids(test[j], query_distances.data());
             for (int i = 0; i < train_dim.first; i++) {
-                result_arr[j*train_dim.first + i] = UnitVectorFormat::from_16bit_fixed_point(filter.estimatedInnerProduct(i));
+                result_arr[j*train_dim.first + i] = UnitVectorFormat::from_16bit_fixed_point(filter.estimatedInnerProduct(query_distances.data(), i));
             }
         }
         H5::DataSet *asym_data = new H5::DataSet(grp->createDataSet("Asymmetric_distance", H5::PredType::NATIVE_FLOAT, space));
@@ -96,13 +96,14 @@ void pqfBench(ankerl::nanobench::Bench *bencher)
     });
 
     
+    std::vector<int16_t> query_distances(pq1.getLookupTableSize());
     bencher->run("building query distances", [&] {
-        pq1.precomp_query_to_centroids(tmp);
+        pq1.precomp_query_to_centroids(tmp, query_distances.data());
     });
 
     bencher->run("Estimated Inner product O(M)", [&] {
         for(unsigned int i = 0; i < 10000; i++){
-            ankerl::nanobench::doNotOptimizeAway(pq1.estimatedInnerProduct(0u));
+            ankerl::nanobench::doNotOptimizeAway(pq1.estimatedInnerProduct(query_distances.data(), 0u));
         }
     });
 
@@ -140,6 +141,32 @@ void imp(ankerl::nanobench::Bench *bencher){
     */   
 }
 
+void sketchLayoutBench(ankerl::nanobench::Bench *bencher){
+    std::vector<std::vector<float>> data;
+    std::string data_path = "data/glove-25-angular.hdf5";
+    auto dims = utils::load(data, "train", data_path, 500000);
+    // Both indexes use the same memory, so the one with table sketches has fewer tables.
+    puffinn::Index<puffinn::CosineSimilarity> index(dims.second, 1024*1024*1024, false);
+    puffinn::Index<puffinn::CosineSimilarity> table_index(dims.second, 1024*1024*1024, false);
+    table_index.set_table_sketches(true);
+    for (std::vector<float> & v : data) {
+        index.insert(v);
+        table_index.insert(v);
+    }
+    index.rebuild();
+    table_index.rebuild();
+    size_t query_idx = 0;
+    bencher->run("search with sketches by point", [&] {
+        query_idx = (query_idx+1000)%data.size();
+        ankerl::nanobench::doNotOptimizeAway(index.search(data[query_idx], 10, 0.9));
+    });
+    query_idx = 0;
+    bencher->run("search with sketches by table", [&] {
+        query_idx = (query_idx+1000)%data.size();
+        ankerl::nanobench::doNotOptimizeAway(table_index.search(data[query_idx], 10, 0.9));
+    });
+}
+
 void correctnessMeassurementPQ(){
 
     std::vector<std::vector<float>> data;
@@ -185,6 +212,7 @@ void all_bench()
     bencher.minEpochIterations(2000);
     //correctnessMeassurementPQ();
     imp(&bencher);
+    sketchLayoutBench(&bencher);
     //mahaBench(&bencher);
     //eucBench(&bencher);
 
@@ -0,0 +1,118 @@
+#pragma once
+
+#if defined(__AVX2__) || defined(__AVX__)
+    #include <immintrin.h>
+#endif
+
+#include "puffinn/mmap.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+namespace puffinn {
+    // An array of unsigned integers that are stored using a fixed number of bits each.
+    class BitPackedArray {
+        // Number of bits used for each value.
+        unsigned int bits;
+        // Number of stored values.
+        size_t len;
+        // Packed values followed by a word of padding, so that 8 bytes can
+        // always be read at the position of a value.
+        MappableArray<uint64_t> words;
+
+    public:
+        // Construct an empty array.
+        BitPackedArray()
+          : bits(1),
+            len(0),
+            words(1, 0)
+        {
+        }
+
+        // Construct an array of `len` zeroes, where every value has the given number of bits.
+        BitPackedArray(size_t len, unsigned int bits)
+          : bits(bits),
+            len(len),
+            words((len*bits+63)/64+1, 0)
+        {
+        }
+
+        BitPackedArray(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&bits), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
+            read_section(in, words);
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&bits), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&len), sizeof(size_t));
+            write_section(out, words.data(), words.size());
+        }
+
+        // Number of bits necessary to store every value up to and including max_value.
+        static unsigned int bits_needed(uint32_t max_value) {
+            unsigned int res = 1;
+            while (res < 32 && (max_value >> res) != 0) {
+                res++;
+            }
+            return res;
+        }
+
+        // Store a value at the given position, which must not have been set before.
+        void set(size_t idx, uint32_t value) {
+            size_t bit = idx*bits;
+            size_t word = bit/64;
+            unsigned int offset = bit%64;
+            words[word] |= static_cast<uint64_t>(value) << offset;
+            if (offset+bits > 64) {
+                words[word+1] |= static_cast<uint64_t>(value) >> (64-offset);
+            }
+        }
+
+        uint32_t get(size_t idx) const {
+            size_t bit = idx*bits;
+            uint64_t word;
+            std::memcpy(&word, reinterpret_cast<const char*>(words.data())+bit/8, sizeof(uint64_t));
+            return (word >> (bit%8)) & ((1ull << bits)-1);
+        }
+
+        // Decode the values at positions [first, last) into out.
+        void decode(size_t first, size_t last, uint32_t* out) const {
+            size_t idx = first;
+            #ifdef __AVX2__
+                // Each value is read using a 32-bit gather, which requires the value and its offset
+                // within the first byte to fit in 32 bits. Bit positions also need to fit in 32 bits.
+                if (bits <= 25 && last*bits < INT32_MAX) {
+                    const __m256i offsets = _mm256_mullo_epi32(
+                        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                        _mm256_set1_epi32(bits));
+                    const __m256i mask = _mm256_set1_epi32((1u << bits)-1);
+                    const __m256i low_bits = _mm256_set1_epi32(7);
+                    auto base = reinterpret_cast<const int*>(words.data());
+                    for (; idx+8 <= last; idx += 8) {
+                        __m256i bit = _mm256_add_epi32(_mm256_set1_epi32(idx*bits), offsets);
+                        __m256i values = _mm256_i32gather_epi32(base, _mm256_srli_epi32(bit, 3), 1);
+                        values = _mm256_srlv_epi32(values, _mm256_and_si256(bit, low_bits));
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(&out[idx-first]),
+                            _mm256_and_si256(values, mask));
+                    }
+                }
+            #endif
+            for (; idx < last; idx++) {
+                out[idx-first] = get(idx);
+            }
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+        static uint64_t memory_usage(size_t len, unsigned int bits) {
+            return sizeof(BitPackedArray) + ((len*bits+63)/64+1)*sizeof(uint64_t);
+        }
+    };
+}
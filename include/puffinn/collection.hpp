@@ -7,6 +7,7 @@
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/maxbuffer.hpp"
+#include "puffinn/mmap.hpp"
 #include "puffinn/prefixmap.hpp"
 #include "pq_filter.hpp"
 #include "puffinn/typedefs.hpp"
@@ -15,6 +16,7 @@
 #include <cassert>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <vector>
 #include <typeinfo>
@@ -34,9 +36,35 @@ namespace puffinn {
         /// It is only intended to be used to fairly assess the impact of sketching on the result. 
         Simple,
         // A simple approach wich mirror Simple, but uses Product quantization to filter
-        PQ_Simple
+        PQ_Simple,
+        /// Searches like ``Default``, but filters candidates using inner products estimated with product quantization
+        /// instead of sketches.
+        /// The recall is not guaranteed: a neighbor whose inner product is underestimated by more than
+        /// the margin estimated when rebuilding is never returned, whatever the recall parameter is,
+        /// and these misses are not accounted for when deciding to stop.
+        /// The achieved recall can therefore be well below the requested recall.
+        /// Only supported by indexes using ``CosineSimilarity`` that are constructed with product quantization.
+        /// Otherwise ``Default`` is used.
+        PQ
     };
 
+    // Identifies the start of a serialized index.
+    const uint32_t SERIALIZATION_MAGIC = 0x4e464650;
+    // Changed whenever the serialized layout of an index changes.
+    const uint32_t SERIALIZATION_VERSION = 4;
+
+    // Read the start of a serialized index and check that its layout is supported.
+    std::istream& read_serialization_header(std::istream& in) {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        in.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
+        in.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+        if (magic != SERIALIZATION_MAGIC || version != SERIALIZATION_VERSION) {
+            throw std::invalid_argument("serialization version");
+        }
+        return in;
+    }
+
     class ChunkSerializable {
     public:
         virtual void serialize_chunk(std::ostream&, size_t) const = 0;
@@ -65,6 +93,16 @@ namespace puffinn {
         }
     };
 
+    /// A graph stored in compressed sparse row format.
+    struct KnnGraph {
+        /// The neighbors of the i'th node are stored in ``neighbors`` from position
+        /// ``offsets[i]``, inclusive, to ``offsets[i+1]``, exclusive.
+        std::vector<uint64_t> offsets;
+        /// Indices of the neighbors of every node.
+        /// Each list is ordered so that the most similar neighbor is first.
+        std::vector<uint32_t> neighbors;
+    };
+
     /// An index constructed over a dataset which supports approximate
     /// near-neighbor queries for a specific similarity measure.
     /// 
@@ -86,18 +124,24 @@ namespace puffinn {
     /// @param TSketch The family of 1-bit Locality-Sensitive hash functions
     /// used to further filter candidates.
     /// Defaults to a family chosen by the similarity measure.
+    /// @param TSketchParams The number and width of the sketches, see ``SketchParams``.
+    /// Defaults to 32 sketches of 64 bits per value.
     template <
         typename TSim,
         typename THash = typename TSim::DefaultHash,
-        typename TSketch = typename TSim::DefaultSketch
+        typename TSketch = typename TSim::DefaultSketch,
+        typename TSketchParams = SketchParams<>
     >
     class Index : ChunkSerializable {
+        using Map = PrefixMap<THash, typename TSketchParams::Word>;
+        const static unsigned int NUM_SKETCHES = TSketchParams::NUM_SKETCHES;
+
         Dataset<typename TSim::Format> dataset;
         // Hash tables used by LSH.
-        std::vector<PrefixMap<THash>> lsh_maps;
+        std::vector<Map> lsh_maps;
         std::unique_ptr<HashSource<THash>> hash_source;
         // Container of sketches. Also needs to be reset.
-        Filterer<TSketch> filterer;
+        Filterer<TSketch, TSketchParams> filterer;
         
 
         // Number of bytes allowed to be used.
@@ -107,9 +151,24 @@ namespace puffinn {
         // Construction of the hash source is delayed until the
         // first rebuild so that we know how many tables are at most used.
         std::unique_ptr<HashSourceArgs<THash>> hash_args;
+        // Whether the hash tables are stored compressed.
+        bool compress_tables = false;
+        // Whether uncompressed hash tables store a sketch of each value in table order.
+        bool table_sketches = false;
+        // Number of candidates per requested neighbor that are ranked by their estimated
+        // similarity before their actual similarity is computed. Zero disables re-ranking.
+        unsigned int pq_rerank_factor = 0;
+        // Number of values inserted since the last rebuild at which the index is
+        // automatically rebuilt. Zero disables automatic rebuilds.
+        uint32_t rebuild_threshold = 0;
+        // One bit for each inserted value, which is set if the value is removed.
+        // Removed values remain in the tables until the index is compacted.
+        MappableArray<uint64_t> tombstones;
         std::unique_ptr<PQFilter> pq;
 
     public:
+        class SearchContext;
+
         /// Construct an empty index.
         ///
         /// @param dataset_args Arguments specifying how the dataset should be stored,
@@ -138,8 +197,7 @@ namespace puffinn {
         {
             // Construct PQFilter if correct similarity measure and it is requested
             if (use_pq) {
-                if constexpr (std::is_same<CosineSimilarity, TSim>::value) 
-                    pq = std::unique_ptr<PQFilter>(new PQFilter(dataset, 4, 256));//, KMeans::distanceType::mahalanobis));
+                pq = make_pq_filter(4, 256, std::is_same<CosineSimilarity, TSim>());//, KMeans::distanceType::mahalanobis));
             }
             static_assert(
                 std::is_same<TSim, typename THash::Sim>::value
@@ -151,8 +209,10 @@ namespace puffinn {
         ///
         /// It is assumed that the input data is a serialized index
         /// using the same version of PUFFINN.
+        /// If the stream is a ``MappedInputStream``, the dataset, hash tables and sketches
+        /// refer directly to the mapped file instead of being copied.
         Index(std::istream& in)
-          : dataset(in),
+          : dataset(read_serialization_header(in)),
             filterer(in)
         {
             hash_args = deserialize_hash_args<THash>(in);
@@ -174,9 +234,21 @@ namespace puffinn {
             }
             in.read(reinterpret_cast<char*>(&memory_limit), sizeof(uint64_t));
             in.read(reinterpret_cast<char*>(&last_rebuild), sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(&compress_tables), sizeof(bool));
+            in.read(reinterpret_cast<char*>(&table_sketches), sizeof(bool));
+            read_section(in, tombstones);
+        }
+
+        /// Load an index that was serialized to the given file by mapping the file into memory.
+        ///
+        /// Loading is nearly instant, since the contents are only read when accessed.
+        /// Processes that load the same file share the memory used for it,
+        /// until the index is modified by inserting values and rebuilding.
+        Index(const std::string& path)
+          : Index(MappedInputStream(path).stream())
+        {
         }
 
-       
         /// Deserialize a single chunk.
         void deserialize_chunk(std::istream& in) {
             // Assumes that hash_source is non-null,
@@ -192,6 +264,8 @@ namespace puffinn {
         ///
         /// @param use_chunks Whether to split the serialized index into chunks. Defaults to false.
         void serialize(std::ostream& out, bool use_chunks = false) const {
+            out.write(reinterpret_cast<const char*>(&SERIALIZATION_MAGIC), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&SERIALIZATION_VERSION), sizeof(uint32_t));
             dataset.serialize(out);
             filterer.serialize(out);
             hash_args->serialize(out);
@@ -210,6 +284,9 @@ namespace puffinn {
             }
             out.write(reinterpret_cast<const char*>(&memory_limit), sizeof(uint64_t));
             out.write(reinterpret_cast<const char*>(&last_rebuild), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&compress_tables), sizeof(bool));
+            out.write(reinterpret_cast<const char*>(&table_sketches), sizeof(bool));
+            write_section(out, tombstones.data(), tombstones.size());
         }
 
         /// Get an iterator over serialized chunks in the dataset.
@@ -220,15 +297,99 @@ namespace puffinn {
 
         /// Insert a value into the index.
         ///
-        /// Before the value can be found using the ``search`` method,
-        /// ``rebuild`` must be called.
+        /// The value can be found by ``search`` immediately.
+        /// Until ``rebuild`` is called, it is stored in a buffer of unindexed values,
+        /// which is scanned in full by every search. See ``set_rebuild_threshold``
+        /// for how to keep this buffer small.
         /// 
         /// @param value The value to insert.
         /// The type must be supported by the format used by ``TSim``.
         template <typename T>
         void insert(const T& value) {
             dataset.insert(value);
+            tombstones.resize((dataset.get_size()+63)/64);
             // Dont insert into the hash tables as it would be in linear time.
+            // Rebuilds are only automatic once the number of tables has been decided.
+            if (
+                rebuild_threshold != 0 && hash_source
+                && dataset.get_size()-last_rebuild >= rebuild_threshold
+            ) {
+                rebuild_tables(false);
+            }
+        }
+
+        /// Set the number of values that can be inserted after the last rebuild
+        /// before the index is automatically rebuilt by ``insert``.
+        ///
+        /// Values that are not yet in the hash tables are compared to every query,
+        /// so a low threshold keeps searches fast while values are being inserted.
+        /// Since only the new values are hashed and merged into the tables,
+        /// frequent rebuilds are relatively cheap.
+        /// The new values are encoded using the existing product quantization codebook, which is only
+        /// retrained by these rebuilds once the number of values has doubled since it was trained.
+        /// The first rebuild must still be called explicitly.
+        /// Defaults to 0, which disables automatic rebuilds.
+        void set_rebuild_threshold(uint32_t threshold) {
+            rebuild_threshold = threshold;
+        }
+
+        /// Remove a value from the index.
+        ///
+        /// The value is immediately excluded from search results,
+        /// but it keeps using memory until ``compact`` is called.
+        /// Other values keep their indices.
+        /// This should not be called while the index is being searched.
+        ///
+        /// @param idx The index of the value to remove.
+        void remove(uint32_t idx) {
+            if (idx >= dataset.get_size()) {
+                throw std::invalid_argument("idx");
+            }
+            tombstones[idx/64] |= 1ull << (idx%64);
+        }
+
+        /// Check whether the value with the given index has been removed.
+        bool is_removed(uint32_t idx) const {
+            return (tombstones[idx/64] >> (idx%64)) & 1;
+        }
+
+        /// Free the memory used by removed values.
+        ///
+        /// The remaining values are given new indices, which keep their order.
+        /// That is, the new index of a value is its previous index minus the number
+        /// of removed values with a lower index.
+        /// The hash tables are filtered without recomputing any hashes,
+        /// so this is much faster than ``rebuild``.
+        void compact() {
+            std::vector<uint32_t> new_indices(dataset.get_size());
+            uint32_t num_remaining = 0;
+            uint32_t num_rebuilt = 0;
+            for (uint32_t idx=0; idx < dataset.get_size(); idx++) {
+                if (is_removed(idx)) {
+                    new_indices[idx] = REMOVED_INDEX;
+                } else {
+                    new_indices[idx] = num_remaining;
+                    num_remaining++;
+                    num_rebuilt += (idx < last_rebuild);
+                }
+            }
+            if (num_remaining == dataset.get_size()) {
+                return;
+            }
+
+            dataset.compact(new_indices);
+            filterer.compact(new_indices);
+            if (pq) {
+                pq->compact(new_indices);
+            }
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t map_idx=0; map_idx < lsh_maps.size(); map_idx++) {
+                lsh_maps[map_idx].compact(new_indices);
+                store_table_sketches(map_idx);
+                store_table_pq_codes(map_idx);
+            }
+            last_rebuild = num_rebuilt;
+            tombstones.assign((num_remaining+63)/64, 0);
         }
 
         /// Retrieve the n'th value inserted into the index.
@@ -243,86 +404,79 @@ namespace puffinn {
                 dataset.get_description());
         }
 
-        /// Rebuild the index using the currently inserted points.
-        /// 
-        /// This is done in parallel by default.
-        /// The number of threads used can be specified using the
-        /// OMP_NUM_THREADS environment variable.
-        void rebuild() {
-
-            // Compute sketches for the new vectors.
-            filterer.add_sketches(dataset, last_rebuild);
-
-            auto desc = dataset.get_description();
-            auto table_bytes = PrefixMap<THash>::memory_usage(dataset.get_size(), hash_args->function_memory_usage(desc, MAX_HASHBITS));
-            auto filterer_bytes = filterer.memory_usage(desc);
-            uint64_t required_mem = dataset.memory_usage()+filterer_bytes; 
-            if (pq) {
-                pq->rebuild();
-                required_mem += pq->memory_usage();
-            }
+        /// Set whether the hash tables should be stored compressed.
+        ///
+        /// Compressed tables use roughly a third of the memory,
+        /// so more tables fit within the memory limit.
+        /// Ranges of candidates are decoded during the search, which makes each table slightly
+        /// slower to search.
+        /// This takes effect the next time ``rebuild`` is called. Defaults to false.
+        /// The number of tables is decided by the first call to ``rebuild``,
+        /// so this should be set before then for the saved memory to be used for more tables.
+        void set_compressed_tables(bool compress) {
+            compress_tables = compress;
+        }
 
-            unsigned int num_tables = 0;
-            uint64_t table_mem = 0;
-            while (required_mem + table_mem < memory_limit) {
-                num_tables++;
-                table_mem = hash_args->memory_usage(desc, num_tables, MAX_HASHBITS)
-                    + num_tables * table_bytes;
-            }
-            if (num_tables != 0) {
-                num_tables--;
-            }
+        /// Set whether each hash table should store a copy of one sketch per value,
+        /// in the same order as the values in the table.
+        ///
+        /// The candidates found in a table can then be filtered by scanning
+        /// contiguous memory, instead of looking up the sketches of each candidate.
+        /// This uses one additional sketch word per value in each table, so fewer tables fit
+        /// within the memory limit. Queries are then faster, but the recall achieved
+        /// beyond the requested recall is typically lower.
+        /// Only the default filter type uses these sketches.
+        /// Compressed tables do not store sketches, so this has no effect when ``set_compressed_tables`` is used.
+        /// This takes effect the next time ``rebuild`` is called. Defaults to false.
+        void set_table_sketches(bool use_table_sketches) {
+            table_sketches = use_table_sketches;
+        }
 
-            // Not enough memory for at least one table
-            if (num_tables == 0) {
-                throw std::invalid_argument("insufficient memory");
+        /// Set whether the product quantization filter uses 4-bit codes with 16 centroids per subspace.
+        ///
+        /// The vectors are split into 8 subspaces instead of the default of 4 subspaces with 256 centroids,
+        /// so each centroid is less precise.
+        /// Each hash table then also stores the codes in the same order as its values, in blocks of 32 values,
+        /// which uses 4 additional bytes per value in each table, so fewer tables fit within the memory limit.
+        /// ``FilterType::PQ_Simple`` estimates a whole block of candidates at once from these codes,
+        /// using the quantized inner products between the query and the centroids,
+        /// instead of looking up the code of each candidate separately.
+        /// Compressed tables do not store the codes.
+        /// This has no effect if the index was constructed without product quantization.
+        /// This takes effect the next time ``rebuild`` is called. Defaults to false.
+        void set_pq_fast_scan(bool use_fast_scan) {
+            if (!pq) {
+                return;
             }
-
-            // if rebuild has been called before
-            if (hash_source) {
-                // Resize the number of tables
-                while (lsh_maps.size() > num_tables) {
-                    // Discard the last tables. Since values are never deleted,
-                    // the number of tables is not going to increase again.
-                    lsh_maps.pop_back();
-                }
+            if (use_fast_scan) {
+                pq = make_pq_filter(8, PQ_FAST_SCAN_CENTROIDS, std::is_same<CosineSimilarity, TSim>());
             } else {
-                hash_source = hash_args->build(
-                    dataset.get_description(),
-                    num_tables,
-                    MAX_HASHBITS);
-                // Construct the prefixmaps.
-                lsh_maps.reserve(num_tables);
-                for (unsigned int repetition=0; repetition < num_tables; repetition++) {
-                    lsh_maps.emplace_back(this->hash_source->sample(), MAX_HASHBITS);
-                }
-            }
-
-            for (auto& map : lsh_maps) {
-                map.reserve(dataset.get_size());
+                pq = make_pq_filter(4, 256, std::is_same<CosineSimilarity, TSim>());
             }
+        }
 
-            // Compute hashes for the new vectors in order, so that caching works.
-            // Hash a vector in all the different ways needed.
-            for (size_t idx=last_rebuild; idx < dataset.get_size(); idx++) {
-                auto hash_state = this->hash_source->reset(dataset[idx], true);
-                // Only parallelize if this step is computationally expensive.
-                if (hash_source->precomputed_hashes()) {
-                    for (auto& map : lsh_maps) {
-                        map.insert(idx, hash_state.get());
-                    }
-                } else {
-                    #pragma omp parallel for
-                    for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
-                        lsh_maps[map_idx].insert(idx, hash_state.get());
-                    }
-                }
-            }
+        /// Set how many candidates per requested neighbor are kept when searching with ``FilterType::PQ``.
+        ///
+        /// When nonzero, candidates are ranked by their similarity estimated using product quantization.
+        /// While searching, the similarity of a candidate is only computed using its full vector if its estimate
+        /// is among the ``factor*k`` best estimates seen so far.
+        /// The other candidates are compared after the search if they pass the filter using the final ``k``'th best similarity.
+        /// This avoids reading the vectors of most candidates, which is useful when the dataset is mapped from disk.
+        /// Candidates are discarded by the same criterion as without re-ranking, so the recall is the same as that of ``FilterType::PQ``.
+        /// Note that this criterion allows for an estimation error that is only exceeded occasionally,
+        /// so the requested recall is not strictly guaranteed when using ``FilterType::PQ``.
+        /// Defaults to 0, in which case the similarity of every candidate passing the filter is computed immediately.
+        void set_pq_rerank(unsigned int factor) {
+            pq_rerank_factor = factor;
+        }
 
-            for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
-                lsh_maps[map_idx].rebuild();
-            }
-            last_rebuild = dataset.get_size();
+        /// Rebuild the index using the currently inserted points.
+        /// 
+        /// This is done in parallel by default.
+        /// The number of threads used can be specified using the
+        /// OMP_NUM_THREADS environment variable.
+        void rebuild() {
+            rebuild_tables(true);
         }
 
         /// Search for the approximate ``k`` nearest neighbors to a query.
@@ -346,10 +500,88 @@ namespace puffinn {
             unsigned int k,
             float recall,
             FilterType filter_type = FilterType::Default
+        ) const {
+            SearchContext ctx;
+            return search(query, k, recall, ctx, filter_type);
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to a query
+        /// using caller-owned scratch memory.
+        ///
+        /// Searching does not modify the index, so multiple threads can search
+        /// the same index concurrently as long as each thread uses its own ``SearchContext``.
+        /// Reusing a context for subsequent queries also avoids repeated allocations.
+        /// The remaining parameters are the same as in ``search`` without a context.
+        template <typename T>
+        std::vector<uint32_t> search(
+            const T& query,
+            unsigned int k,
+            float recall,
+            SearchContext& ctx,
+            FilterType filter_type = FilterType::Default
         ) const {
             auto desc = dataset.get_description();
             auto stored_query = to_stored_type<typename TSim::Format>(query, desc);
-            return search_formatted_query(stored_query.get(), k, recall, filter_type);
+            return search_formatted_query(stored_query.get(), k, recall, filter_type, ctx);
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to each query in a batch.
+        ///
+        /// Queries are distributed dynamically over the available threads,
+        /// each of which uses its own ``SearchContext``.
+        /// The number of threads used can be specified using the
+        /// OMP_NUM_THREADS environment variable.
+        ///
+        /// @param queries The query values.
+        /// They follow the same constraints as when inserting a value.
+        /// The remaining parameters are the same as in ``search``.
+        /// @return For each query in order, the indices of the ``k`` nearest found neighbors.
+        template <typename T>
+        std::vector<std::vector<uint32_t>> search_batch(
+            const std::vector<T>& queries,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) const {
+            // Convert the queries up front, so that invalid input is reported
+            // before any threads are started.
+            Dataset<typename TSim::Format> stored_queries(
+                dataset.get_description().args,
+                std::max(queries.size(), static_cast<size_t>(1)));
+            for (auto& query : queries) {
+                stored_queries.insert(query);
+            }
+            return search_batch(stored_queries, k, recall, filter_type);
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to each query in a batch
+        /// of values that are already stored in the internal format.
+        ///
+        /// The dataset must have been constructed with the same arguments as the index.
+        /// See ``search_batch`` for a description of the remaining parameters.
+        std::vector<std::vector<uint32_t>> search_batch(
+            const Dataset<typename TSim::Format>& queries,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) const {
+            if (queries.get_description().storage_len != dataset.get_description().storage_len) {
+                throw std::invalid_argument("queries");
+            }
+            size_t num_queries = queries.get_size();
+            std::vector<std::vector<uint32_t>> res(num_queries);
+            auto& caller_metrics = g_performance_metrics;
+            #pragma omp parallel
+            {
+                SearchContext ctx;
+                #pragma omp for schedule(dynamic)
+                for (size_t i=0; i < num_queries; i++) {
+                    res[i] = search_formatted_query(queries[i], k, recall, filter_type, ctx);
+                }
+                #pragma omp critical
+                caller_metrics.merge(g_performance_metrics);
+            }
+            return res;
         }
 
         /// Search for the approximate ``k`` nearest neighbors to a value already inserted into the index.
@@ -362,9 +594,24 @@ namespace puffinn {
             unsigned int k,
             float recall,
             FilterType filter_type = FilterType::Default
+        ) const {
+            SearchContext ctx;
+            return search_from_index(idx, k, recall, ctx, filter_type);
+        }
+
+        /// Search for the approximate ``k`` nearest neighbors to a value already inserted into the index
+        /// using caller-owned scratch memory.
+        ///
+        /// See ``search`` for how the context is used.
+        std::vector<uint32_t> search_from_index(
+            uint32_t idx,
+            unsigned int k,
+            float recall,
+            SearchContext& ctx,
+            FilterType filter_type = FilterType::Default
         ) const {
             // search for one more as the query will be part of the result set.
-            auto res = search_formatted_query(dataset[idx], k+1, recall, filter_type);
+            auto res = search_formatted_query(dataset[idx], k+1, recall, filter_type, ctx);
             if (res.size() != 0 && res[0] == idx) {
                 res.erase(res.begin());
             } else {
@@ -373,6 +620,50 @@ namespace puffinn {
             return res;
         }
 
+        /// Construct a graph connecting every point in the index to its approximate ``k`` nearest neighbors.
+        ///
+        /// This is faster than calling ``search_from_index`` for every point,
+        /// as the hashes and sketches computed during ``rebuild`` are reused
+        /// and similarities computed when searching for one point are shared with the other point.
+        /// This is done in parallel.
+        ///
+        /// Only points inserted before the last call to ``rebuild`` are part of the graph.
+        ///
+        /// @param k The number of neighbors of each point. A point is never its own neighbor.
+        /// @param recall The expected recall of each list of neighbors. See ``search``.
+        /// @param filter_type The approach used to filter candidates.
+        /// @return The graph, in which node ``i`` is the i'th inserted point.
+        KnnGraph knn_graph(
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default
+        ) const {
+            uint32_t n = last_rebuild;
+            // Up to k neighbors of each point together with their similarities.
+            std::vector<MaxBuffer::ResultPair> found(static_cast<size_t>(n)*k);
+            std::vector<uint32_t> num_found(n, 0);
+            if (n < 100) {
+                // See search_formatted_query.
+                knn_graph_bf(k, found, num_found);
+            } else {
+                knn_graph_lsh(k, recall, filter_type, found, num_found);
+            }
+
+            KnnGraph graph;
+            graph.offsets.resize(static_cast<size_t>(n)+1);
+            graph.offsets[0] = 0;
+            for (uint32_t idx=0; idx < n; idx++) {
+                graph.offsets[idx+1] = graph.offsets[idx]+num_found[idx];
+            }
+            graph.neighbors.resize(graph.offsets[n]);
+            for (uint32_t idx=0; idx < n; idx++) {
+                for (uint32_t i=0; i < num_found[idx]; i++) {
+                    graph.neighbors[graph.offsets[idx]+i] = found[static_cast<size_t>(idx)*k+i].first;
+                }
+            }
+            return graph;
+        }
+
         /// Search for the k nearest neighbors to a query by 
         /// computing the similarity of each inserted value.
         ///
@@ -405,12 +696,53 @@ namespace puffinn {
         }
 
     private:
+        // Product quantization is only supported for unit vectors compared by cosine similarity.
+        std::unique_ptr<PQFilter> make_pq_filter(unsigned int m, unsigned int k, std::true_type) {
+            return std::unique_ptr<PQFilter>(new PQFilter(dataset, m, k));
+        }
+
+        std::unique_ptr<PQFilter> make_pq_filter(unsigned int, unsigned int, std::false_type) {
+            return nullptr;
+        }
+
+        // Store or discard the sketches of a table depending on the settings.
+        // The j'th table stores the sketches with index j%NUM_SKETCHES.
+        void store_table_sketches(size_t map_idx) {
+            auto& map = lsh_maps[map_idx];
+            if (!table_sketches) {
+                map.clear_sketches();
+                return;
+            }
+            auto sketch_idx = map_idx%NUM_SKETCHES;
+            map.set_sketches([this, sketch_idx](uint32_t idx) {
+                return filterer.get_sketch(idx, sketch_idx);
+            });
+        }
+
+        // Store the fast-scan codes of the PQ filter in a table, in blocks of PQ_FAST_SCAN_BLOCK values.
+        void store_table_pq_codes(size_t map_idx) {
+            auto& map = lsh_maps[map_idx];
+            if (!pq || !pq->fastScanEnabled()) {
+                map.clear_code_blocks();
+                return;
+            }
+            map.set_code_blocks(
+                PQ_FAST_SCAN_BLOCK,
+                pq->getFastScanBlockSize(),
+                [this](uint8_t* block, unsigned int j, uint32_t idx) {
+                    pq->packFastScanCode(block, j, pq->getCode(idx));
+                });
+        }
+
         std::vector<unsigned int> search_bf_formatted_query(
             typename TSim::Format::Type* query,
             unsigned int k
         ) const {
             MaxBuffer res(k);
             for (size_t i=0; i < dataset.get_size(); i++) {
+                if (is_removed(i)) {
+                    continue;
+                }
                 float sim = TSim::compute_similarity(
                     query,
                     dataset[i],
@@ -428,54 +760,232 @@ namespace puffinn {
             typename TSim::Format::Type* query,
             unsigned int k,
             float recall,
-            FilterType filter_type
+            FilterType filter_type,
+            SearchContext& ctx
         ) const {
-            if (dataset.get_size() < 100) {
+            if (dataset.get_size() < 100 || lsh_maps.empty()) {
                 // Due to optimizations values near the edges in prefixmaps are discarded.
                 // When there are fewer total values than SEGMENT_SIZE, all values will be skipped.
                 // However at that point, brute force is likely to be faster regardless.
+                // Before the first rebuild, no values are in the tables.
                 return search_bf_formatted_query(query, k);
             }
             g_performance_metrics.new_query();
             g_performance_metrics.start_timer(Computation::Total);
 
-            MaxBuffer maxbuffer(k);
             g_performance_metrics.start_timer(Computation::Hashing);
             auto hash_state = hash_source->reset(query, false);
             g_performance_metrics.store_time(Computation::Hashing);
 
             g_performance_metrics.start_timer(Computation::Search);
+            ctx.buffers.reset(lsh_maps, hash_state.get());
+            if (uses_sketches(filter_type)) {
+                g_performance_metrics.start_timer(Computation::Sketching);
+                filterer.reset(query, ctx.sketches);
+                g_performance_metrics.store_time(Computation::Sketching);
+            }
+            ctx.maxbuffer.reset(k);
+            ctx.pq_candidates.reset(k*pq_rerank_factor);
+            // Values inserted since the last rebuild are compared first, so that
+            // they contribute to the termination criteria of the search.
+            for (uint32_t idx=last_rebuild; idx < dataset.get_size(); idx++) {
+                if (is_removed(idx)) {
+                    continue;
+                }
+                float sim = TSim::compute_similarity(
+                    query,
+                    dataset[idx],
+                    dataset.get_description());
+                ctx.maxbuffer.insert(idx, sim);
+            }
+            search_prepared_query(query, recall, filter_type, ctx);
+            g_performance_metrics.store_time(Computation::Search);
+
+            auto res = ctx.maxbuffer.best_indices();
+            g_performance_metrics.store_time(Computation::Total);
+            return res;
+        }
+
+        // Store the best entries of the buffer as the neighbors of idx, excluding idx itself.
+        static void store_neighbors(
+            uint32_t idx,
+            unsigned int k,
+            MaxBuffer& buffer,
+            std::vector<MaxBuffer::ResultPair>& found,
+            std::vector<uint32_t>& num_found
+        ) {
+            uint32_t count = 0;
+            for (auto& entry : buffer.best_entries()) {
+                if (entry.first != idx && count < k) {
+                    found[static_cast<size_t>(idx)*k+count] = entry;
+                    count++;
+                }
+            }
+            num_found[idx] = count;
+        }
+
+        void knn_graph_bf(
+            unsigned int k,
+            std::vector<MaxBuffer::ResultPair>& found,
+            std::vector<uint32_t>& num_found
+        ) const {
+            uint32_t n = num_found.size();
+            #pragma omp parallel for schedule(dynamic)
+            for (uint32_t idx=0; idx < n; idx++) {
+                if (is_removed(idx)) {
+                    continue;
+                }
+                // One more, as the point itself is included.
+                MaxBuffer buffer(k+1);
+                for (uint32_t other=0; other < n; other++) {
+                    if (is_removed(other)) {
+                        continue;
+                    }
+                    buffer.insert(other, TSim::compute_similarity(
+                        dataset[idx],
+                        dataset[other],
+                        dataset.get_description()));
+                }
+                store_neighbors(idx, k, buffer, found, num_found);
+            }
+        }
+
+        void knn_graph_lsh(
+            unsigned int k,
+            float recall,
+            FilterType filter_type,
+            std::vector<MaxBuffer::ResultPair>& found,
+            std::vector<uint32_t>& num_found
+        ) const {
+            // Points are processed in at most this many blocks,
+            // bounding the memory used to store their positions in the maps.
+            const uint32_t NUM_BLOCKS = 8;
+            const uint32_t MIN_BLOCK_SIZE = 1024;
+            // Number of locks protecting the shared similarities.
+            const size_t NUM_LOCKS = 64;
+
+            uint32_t n = num_found.size();
+            auto desc = dataset.get_description();
+            size_t num_maps = lsh_maps.size();
+
+            // Similarities computed while searching for other points.
+            // They are used as a starting point when the point is searched for
+            // and are merged into the result afterwards.
+            std::vector<std::vector<MaxBuffer::ResultPair>> shared(n);
+            std::mutex locks[NUM_LOCKS];
+
+            auto& caller_metrics = g_performance_metrics;
+            uint32_t block_size = std::max(MIN_BLOCK_SIZE, (n+NUM_BLOCKS-1)/NUM_BLOCKS);
+            std::vector<uint32_t> positions(std::min(block_size, n)*num_maps);
+            for (uint32_t block_start=0; block_start < n; block_start += block_size) {
+                uint32_t block_end = std::min(n, block_start+block_size);
+                #pragma omp parallel for
+                for (size_t map_idx=0; map_idx < num_maps; map_idx++) {
+                    lsh_maps[map_idx].find_positions(
+                        block_start,
+                        block_end,
+                        &positions[map_idx],
+                        num_maps);
+                }
+
+                #pragma omp parallel
+                {
+                    SearchContext ctx;
+                    #pragma omp for schedule(dynamic)
+                    for (uint32_t idx=block_start; idx < block_end; idx++) {
+                        if (is_removed(idx)) {
+                            continue;
+                        }
+                        auto query = dataset[idx];
+                        g_performance_metrics.new_query();
+                        g_performance_metrics.start_timer(Computation::Total);
+                        g_performance_metrics.start_timer(Computation::Search);
+
+                        ctx.buffers.reset_at(lsh_maps, &positions[(idx-block_start)*num_maps]);
+                        if (uses_sketches(filter_type)) {
+                            filterer.reset_from_index(idx, ctx.sketches);
+                        }
+                        // One more, as the point itself is included.
+                        ctx.maxbuffer.reset(k+1);
+                        ctx.pq_candidates.reset((k+1)*pq_rerank_factor);
+                        ctx.maxbuffer.insert(idx, TSim::compute_similarity(query, query, desc));
+                        {
+                            std::lock_guard<std::mutex> guard(locks[idx%NUM_LOCKS]);
+                            for (auto& entry : shared[idx]) {
+                                ctx.maxbuffer.insert(entry.first, entry.second);
+                            }
+                        }
+                        search_prepared_query(query, recall, filter_type, ctx);
+                        g_performance_metrics.store_time(Computation::Search);
+
+                        store_neighbors(idx, k, ctx.maxbuffer, found, num_found);
+                        for (uint32_t i=0; i < num_found[idx]; i++) {
+                            auto& entry = found[static_cast<size_t>(idx)*k+i];
+                            std::lock_guard<std::mutex> guard(locks[entry.first%NUM_LOCKS]);
+                            shared[entry.first].push_back({ idx, entry.second });
+                        }
+                        g_performance_metrics.store_time(Computation::Total);
+                    }
+                    #pragma omp critical
+                    caller_metrics.merge(g_performance_metrics);
+                }
+            }
+
+            // Include similarities shared after the point was searched for.
+            #pragma omp parallel for schedule(dynamic)
+            for (uint32_t idx=0; idx < n; idx++) {
+                MaxBuffer buffer(k);
+                for (uint32_t i=0; i < num_found[idx]; i++) {
+                    auto& entry = found[static_cast<size_t>(idx)*k+i];
+                    buffer.insert(entry.first, entry.second);
+                }
+                for (auto& entry : shared[idx]) {
+                    buffer.insert(entry.first, entry.second);
+                }
+                store_neighbors(idx, k, buffer, found, num_found);
+            }
+        }
+
+        bool uses_sketches(FilterType filter_type) const {
+            return filter_type == FilterType::Default
+                || filter_type == FilterType::Simple
+                // Without product quantization, the default filter is used instead.
+                || (filter_type == FilterType::PQ && !pq);
+        }
+
+        // Search the tables for a query whose buffers, and sketches if needed, are prepared.
+        // Candidates are added to the maxbuffer of the context.
+        void search_prepared_query(
+            typename TSim::Format::Type* query,
+            float recall,
+            FilterType filter_type,
+            SearchContext& ctx
+        ) const {
+            if (filter_type == FilterType::PQ && !pq) {
+                // The index was constructed without product quantization.
+                filter_type = FilterType::Default;
+            }
             switch (filter_type) {
                 case FilterType::None:
-                    search_maps_no_filter(
-                        query,
-                        maxbuffer,
-                        recall,
-                        hash_state.get());
+                    search_maps_no_filter(query, ctx, recall);
                     break;
                 case FilterType::Simple:
-                    search_maps_simple_filter(
-                        query,
-                        maxbuffer,
-                        recall,
-                        hash_state.get());
+                    search_maps_simple_filter(query, ctx, recall);
                     break;
                 case FilterType::PQ_Simple:
-                    if constexpr (std::is_same<CosineSimilarity, TSim>::value)
-                        search_maps_pq_simple_filter(
-                            query,
-                            maxbuffer,
-                            recall,
-                            hash_state.get());
+                    search_maps_pq_simple_filter(
+                        query, ctx, recall, std::is_same<CosineSimilarity, TSim>());
+                    break;
+                case FilterType::PQ:
+                    search_maps_pq(query, ctx, recall, std::is_same<CosineSimilarity, TSim>());
                     break;
                 default:
-                    search_maps(query, maxbuffer, recall, hash_state.get());
+                    if (!lsh_maps.empty() && lsh_maps[0].has_sketches()) {
+                        search_maps_table_sketches(query, ctx, recall);
+                    } else {
+                        search_maps(query, ctx, recall);
+                    }
             }
-            g_performance_metrics.store_time(Computation::Search);
-
-            auto res = maxbuffer.best_indices();
-            g_performance_metrics.store_time(Computation::Total);
-            return res;
         }
 
         // Size of buffer of 4element segments to consider at once.
@@ -497,36 +1007,67 @@ namespace puffinn {
             // For each range, which table it was taken from.
             std::unique_ptr<uint_fast32_t[]> table_indices;
 
+            // Number of ranges that fit in the allocated arrays.
+            size_t ranges_capacity = 0;
+
             // Stores the range of values that have already been considered.
             // Before a table can be used, the initial point is found through binary search.
             std::vector<PrefixMapQuery> query_objects;
+            // For each table, storage for the current range when the table is compressed.
+            std::vector<std::vector<uint32_t>> decoded_ranges;
 
-
-            SearchBuffers(
-                const std::vector<PrefixMap<THash>>& maps,
+            // Prepare the buffers for a new query.
+            // Memory allocated by previous queries is reused.
+            void reset(
+                const std::vector<Map>& maps,
                 HashSourceState* hash_state
-            )
-            {
+            ) {
                 g_performance_metrics.start_timer(Computation::SearchInit);
 
-                ranges =
-                    std::make_unique<std::pair<const uint32_t*, const uint32_t*>[]>(maps.size()+1);
-                table_indices =
-                    std::make_unique<uint_fast32_t[]>(maps.size()+1);
-
-                query_objects.reserve(maps.size());
+                allocate(maps.size());
                 std::transform(maps.begin(), maps.end(), std::back_inserter(query_objects),
                     [hash_state](auto& map) { return map.create_query(hash_state); });
 
                 g_performance_metrics.store_time(Computation::SearchInit);
             }
 
-            void fill_ranges(const std::vector<PrefixMap<THash>>& maps) {
+            // Prepare the buffers for querying a value that is already stored in the maps.
+            // positions[j] is the position of the value in the j'th map.
+            void reset_at(
+                const std::vector<Map>& maps,
+                const uint32_t* positions
+            ) {
+                g_performance_metrics.start_timer(Computation::SearchInit);
+
+                allocate(maps.size());
+                for (size_t j=0; j < maps.size(); j++) {
+                    query_objects.push_back(maps[j].create_query_at(positions[j]));
+                }
+
+                g_performance_metrics.store_time(Computation::SearchInit);
+            }
+
+            void allocate(size_t num_maps) {
+                if (ranges_capacity < num_maps+1) {
+                    ranges_capacity = num_maps+1;
+                    ranges =
+                        std::make_unique<std::pair<const uint32_t*, const uint32_t*>[]>(ranges_capacity);
+                    table_indices =
+                        std::make_unique<uint_fast32_t[]>(ranges_capacity);
+                }
+                query_objects.clear();
+                query_objects.reserve(num_maps);
+                if (decoded_ranges.size() < num_maps) {
+                    decoded_ranges.resize(num_maps);
+                }
+            }
+
+            void fill_ranges(const std::vector<Map>& maps) {
                 g_performance_metrics.start_timer(Computation::ReducePrefix);
 
                 num_ranges = 0;
                 for (uint_fast32_t j=0; j<maps.size(); j++) {
-                    auto range = maps[j].get_next_range(query_objects[j]);
+                    auto range = maps[j].get_next_range(query_objects[j], decoded_ranges[j]);
                     ranges[num_ranges] = range;
                     table_indices[num_ranges] = j;
                     // Skip empty ranges
@@ -541,14 +1082,138 @@ namespace puffinn {
             }
         };
 
+    public:
+        /// Scratch memory used while answering a query.
+        ///
+        /// See ``search`` for how it is used to query an index from multiple threads.
+        class SearchContext {
+            friend class Index;
+
+            // Best candidates found so far.
+            MaxBuffer maxbuffer = MaxBuffer(0);
+            // Sketches of the current query.
+            QuerySketches<TSketchParams> sketches;
+            // Current position in each table.
+            SearchBuffers buffers;
+            // Inner products between the query and every PQ centroid.
+            std::vector<int16_t> pq_distances;
+            // Quantized inner products used when the PQ filter uses fast-scan codes.
+            PQFastScanTable pq_fast_scan_table;
+            // Best candidates by their estimated similarity when re-ranking.
+            MaxBuffer pq_candidates = MaxBuffer(0);
+            // Candidates that were not among the best estimates when re-ranking,
+            // with their estimated inner products.
+            std::vector<std::pair<uint32_t, int16_t>> pq_deferred;
+        };
+
+    private:
+        // Hashes the values inserted since the last rebuild into the tables.
+        // The product quantization codebook is retrained only if retrain_pq is set.
+        void rebuild_tables(bool retrain_pq) {
+            // Compute sketches for the new vectors.
+            filterer.add_sketches(dataset, last_rebuild);
+
+            auto desc = dataset.get_description();
+            uint64_t pq_code_bytes = 0;
+            if (pq && pq->fastScanEnabled()) {
+                pq_code_bytes = pq->getFastScanBlockSize()/PQ_FAST_SCAN_BLOCK;
+            }
+            auto table_bytes = Map::memory_usage(
+                dataset.get_size(),
+                hash_args->function_memory_usage(desc, MAX_HASHBITS),
+                compress_tables,
+                table_sketches,
+                pq_code_bytes);
+            auto filterer_bytes = filterer.memory_usage(desc);
+            uint64_t required_mem = dataset.memory_usage()+filterer_bytes; 
+            if (pq) {
+                if (retrain_pq) {
+                    pq->rebuild();
+                } else {
+                    pq->update();
+                }
+                required_mem += pq->memory_usage();
+            }
+
+            unsigned int num_tables = 0;
+            uint64_t table_mem = 0;
+            while (required_mem + table_mem < memory_limit) {
+                num_tables++;
+                table_mem = hash_args->memory_usage(desc, num_tables, MAX_HASHBITS)
+                    + num_tables * table_bytes;
+            }
+            if (num_tables != 0) {
+                num_tables--;
+            }
+
+            // Not enough memory for at least one table
+            if (num_tables == 0) {
+                throw std::invalid_argument("insufficient memory");
+            }
+
+            // if rebuild has been called before
+            if (hash_source) {
+                // Resize the number of tables
+                while (lsh_maps.size() > num_tables) {
+                    // Discard the last tables. The hash source is only built for the
+                    // initial number of tables, so it cannot increase again.
+                    lsh_maps.pop_back();
+                }
+            } else {
+                hash_source = hash_args->build(
+                    dataset.get_description(),
+                    num_tables,
+                    MAX_HASHBITS);
+                // Construct the prefixmaps.
+                lsh_maps.reserve(num_tables);
+                for (unsigned int repetition=0; repetition < num_tables; repetition++) {
+                    lsh_maps.emplace_back(this->hash_source->sample(), MAX_HASHBITS);
+                }
+            }
+
+            for (auto& map : lsh_maps) {
+                map.reserve(dataset.get_size());
+            }
+
+            // Compute hashes for the new vectors.
+            // Each thread hashes a contiguous range of vectors in all the different ways needed,
+            // so that the state of the hash source is only computed once per vector.
+            // Every vector has a reserved slot in each table, so no synchronization is needed.
+            size_t num_new = dataset.get_size()-last_rebuild;
+            std::vector<size_t> first_slots;
+            first_slots.reserve(lsh_maps.size());
+            for (auto& map : lsh_maps) {
+                first_slots.push_back(map.prepare_insert(num_new));
+            }
+            #pragma omp parallel for schedule(static)
+            for (size_t i=0; i < num_new; i++) {
+                uint32_t idx = last_rebuild+i;
+                auto hash_state = this->hash_source->reset(dataset[idx], false);
+                for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
+                    lsh_maps[map_idx].insert_at(first_slots[map_idx]+i, idx, hash_state.get());
+                }
+            }
+
+            // Tables are independent, so they are sorted in parallel.
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
+                lsh_maps[map_idx].set_compressed(compress_tables);
+                lsh_maps[map_idx].rebuild();
+                store_table_sketches(map_idx);
+                store_table_pq_codes(map_idx);
+            }
+            last_rebuild = dataset.get_size();
+        }
+
+
         // Search the tables without any filters.
         void search_maps_no_filter(
             typename TSim::Format::Type* query,
-            MaxBuffer& maxbuffer,
-            float recall,
-            HashSourceState* hash_state
+            SearchContext& ctx,
+            float recall
         ) const {
-            SearchBuffers buffers(lsh_maps, hash_state);
+            auto& maxbuffer = ctx.maxbuffer;
+            auto& buffers = ctx.buffers;
             for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
                 buffers.fill_ranges(lsh_maps);
                 g_performance_metrics.start_timer(Computation::Consider);
@@ -556,11 +1221,13 @@ namespace puffinn {
                     auto range = buffers.ranges[range_idx];
                     while (range.first != range.second) {
                         auto idx = *range.first;
-                        auto dist = TSim::compute_similarity(
-                            query,
-                            dataset[idx],
-                            dataset.get_description());
-                        maxbuffer.insert(idx, dist);
+                        if (!is_removed(idx)) {
+                            auto dist = TSim::compute_similarity(
+                                query,
+                                dataset[idx],
+                                dataset.get_description());
+                            maxbuffer.insert(idx, dist);
+                        }
                         range.first++;
                     }
                 }
@@ -585,24 +1252,65 @@ namespace puffinn {
             }
         }
         void search_maps_pq_simple_filter(
-            typename CosineSimilarity::Format::Type* query,
-            MaxBuffer& maxbuffer,
+            typename TSim::Format::Type* query,
+            SearchContext& ctx,
             float recall,
-            HashSourceState* hash_state
+            std::true_type
         ) const {
             assert(pq);
-            SearchBuffers buffers(lsh_maps, hash_state);
-
-            pq->precomp_query_to_centroids(query);
+            auto& maxbuffer = ctx.maxbuffer;
+            auto& buffers = ctx.buffers;
+
+            // The tables only store the fast-scan codes once the index is rebuilt with them.
+            bool fast_scan =
+                pq->fastScanEnabled() && !lsh_maps.empty() && lsh_maps[0].has_code_blocks();
+            ctx.pq_distances.resize(pq->getLookupTableSize());
+            if (fast_scan) {
+                pq->precompFastScanTable(query, ctx.pq_distances.data(), ctx.pq_fast_scan_table);
+            } else {
+                pq->precomp_query_to_centroids(query, ctx.pq_distances.data());
+            }
             int16_t limit = UnitVectorFormat::to_16bit_fixed_point(pq->bootThreshold);
+            // Number of candidates ahead in the range whose codes are prefetched.
+            const static int PQ_PREFETCH_DIST = 8;
             //std::cout << "this is the boot threshold: " << pq->getBootThreshold() << std::endl;
             for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
                 buffers.fill_ranges(lsh_maps);
+                g_performance_metrics.start_timer(Computation::Consider);
                 for (uint_fast32_t range_idx=0; range_idx < buffers.num_ranges; range_idx++) {
                     auto range = buffers.ranges[range_idx];
+                    if (fast_scan) {
+                        // Estimate every candidate in a block of codes stored in the table at once.
+                        auto& map = lsh_maps[buffers.table_indices[range_idx]];
+                        int16_t estimates[PQ_FAST_SCAN_BLOCK];
+                        size_t pos = map.get_position(range.first);
+                        while (range.first != range.second) {
+                            pq->estimatedInnerProducts(
+                                ctx.pq_fast_scan_table, map.get_code_block(pos), estimates);
+                            auto block_end = std::min(
+                                range.second,
+                                range.first+(PQ_FAST_SCAN_BLOCK-pos%PQ_FAST_SCAN_BLOCK));
+                            for (; range.first != block_end; range.first++, pos++) {
+                                auto idx = *range.first;
+                                if (!is_removed(idx) && estimates[pos%PQ_FAST_SCAN_BLOCK] > limit) {
+                                    auto dist = TSim::compute_similarity(
+                                        query,
+                                        dataset[idx],
+                                        dataset.get_description());
+                                    maxbuffer.insert(idx, dist);
+                                }
+                            }
+                        }
+                    }
                     while (range.first != range.second) {
                         auto idx = *range.first;
-                        if (pq->estimatedInnerProduct(idx) > limit) {
+                        if (range.second-range.first > PQ_PREFETCH_DIST) {
+                            pq->prefetch(range.first[PQ_PREFETCH_DIST]);
+                        }
+                        if (
+                            !is_removed(idx)
+                            && pq->estimatedInnerProduct(ctx.pq_distances.data(), idx) > limit
+                        ) {
                             auto dist = TSim::compute_similarity(
                                 query,
                                 dataset[idx],
@@ -637,18 +1345,23 @@ namespace puffinn {
             }
         }
 
+        void search_maps_pq_simple_filter(
+            typename TSim::Format::Type*,
+            SearchContext&,
+            float,
+            std::false_type
+        ) const {
+        }
+
         // Search maps with a simple implementation of filtering.
         void search_maps_simple_filter(
             typename TSim::Format::Type* query,
-            MaxBuffer& maxbuffer,
-            float recall,
-            HashSourceState* hash_state
+            SearchContext& ctx,
+            float recall
         ) const {
-            g_performance_metrics.start_timer(Computation::Sketching);
-            QuerySketches sketches = filterer.reset(query);
-            g_performance_metrics.store_time(Computation::Sketching);
-
-            SearchBuffers buffers(lsh_maps, hash_state);
+            auto& maxbuffer = ctx.maxbuffer;
+            auto& sketches = ctx.sketches;
+            auto& buffers = ctx.buffers;
             for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
                 buffers.fill_ranges(lsh_maps);
                 g_performance_metrics.start_timer(Computation::Consider);
@@ -658,7 +1371,7 @@ namespace puffinn {
                         auto idx = *range.first;
                         auto sketch_idx = range_idx%NUM_SKETCHES;
                         auto sketch = filterer.get_sketch(idx, sketch_idx);
-                        if (sketches.passes_filter(sketch, sketch_idx)) {
+                        if (sketches.passes_filter(sketch, sketch_idx) && !is_removed(idx)) {
                             auto dist = TSim::compute_similarity(
                                 query,
                                 dataset[idx],
@@ -691,24 +1404,125 @@ namespace puffinn {
             }
         }
 
-        // Search all maps and insert the candidates into the buffer.
-        void search_maps(
+        // Append the values in a segment of four that pass the filter at the given sketch index
+        // to out, which needs room for four values. Returns the number of appended values.
+        uint_fast32_t filter_segment(
+            const uint32_t* segment,
+            int_fast32_t sketch_idx,
+            const QuerySketches<TSketchParams>& sketches,
+            uint32_t* out
+        ) const {
+            auto mask = sketches.passes_filter4(
+                filterer.get_sketch(segment[0], sketch_idx),
+                filterer.get_sketch(segment[1], sketch_idx),
+                filterer.get_sketch(segment[2], sketch_idx),
+                filterer.get_sketch(segment[3], sketch_idx),
+                sketch_idx);
+            return append_passing4(out, segment, mask);
+        }
+
+        // Filters the candidates of search_maps_ring using the sketches of the query.
+        struct SketchRingFilter {
+            const Index& index;
+            QuerySketches<TSketchParams>& sketches;
+
+            // Fetch the sketches of a segment into cache before it is filtered.
+            void prefetch(const uint32_t* segment, int_fast32_t sketch_idx) const {
+                index.filterer.prefetch(segment[0], sketch_idx);
+                index.filterer.prefetch(segment[1], sketch_idx);
+                index.filterer.prefetch(segment[2], sketch_idx);
+                index.filterer.prefetch(segment[3], sketch_idx);
+            }
+
+            uint_fast32_t filter(const uint32_t* segment, int_fast32_t sketch_idx, uint32_t* out) const {
+                return index.filter_segment(segment, sketch_idx, sketches, out);
+            }
+
+            // Choose which of the candidates that passed the filter have their similarity computed.
+            uint_fast32_t select(uint32_t*, uint_fast32_t num_candidates) const {
+                return num_candidates;
+            }
+
+            // Whether the vectors of the selected candidates are prefetched.
+            bool prefetch_vectors() const {
+                return false;
+            }
+
+            // Adjust the filter to the similarity of the current k'th best value.
+            void update(float kth_similarity) {
+                sketches.max_sketch_diff = index.filterer.get_max_sketch_diff(kth_similarity);
+            }
+        };
+
+        // Filters the candidates of search_maps_ring by their inner products with the query,
+        // estimated using product quantization.
+        struct PQRingFilter {
+            const Index& index;
+            SearchContext& ctx;
+            const int16_t* pq_distances;
+            // When re-ranking, only candidates whose estimated similarity is among the best
+            // have their actual similarity computed.
+            bool rerank;
+            int16_t limit;
+
+            void prefetch(const uint32_t* segment, int_fast32_t) const {
+                index.pq->prefetch(segment[0]);
+                index.pq->prefetch(segment[1]);
+                index.pq->prefetch(segment[2]);
+                index.pq->prefetch(segment[3]);
+            }
+
+            uint_fast32_t filter(const uint32_t* segment, int_fast32_t, uint32_t* out) const {
+                return index.filter_segment_pq(segment, pq_distances, limit, out);
+            }
+
+            uint_fast32_t select(uint32_t* candidates, uint_fast32_t num_candidates) const {
+                if (!rerank) {
+                    return num_candidates;
+                }
+                return index.rank_pq_candidates(candidates, num_candidates, pq_distances, ctx);
+            }
+
+            bool prefetch_vectors() const {
+                return rerank;
+            }
+
+            void update(float kth_similarity) {
+                limit = index.pq_limit(kth_similarity);
+            }
+        };
+
+        // Candidates need an estimated inner product above that of the current k'th best value,
+        // minus a margin for the estimation error.
+        int16_t pq_limit(float kth_similarity) const {
+            int32_t limit = UnitVectorFormat::to_16bit_fixed_point(2*kth_similarity-1);
+            limit -= pq->estimationMargin;
+            return static_cast<int16_t>(std::max(limit, (int32_t)INT16_MIN));
+        }
+
+        // Search all maps and insert the candidates passing the filter into the buffer.
+        //
+        // Segments of four candidates are taken from the ranges of each table in turn and
+        // kept in a ring of RING_SIZE segments, so that the data needed to filter a segment
+        // can be prefetched before it is filtered. See SketchRingFilter for the interface of TFilter.
+        template <typename TFilter>
+        void search_maps_ring(
             typename TSim::Format::Type* query,
-            MaxBuffer& maxbuffer,
+            SearchContext& ctx,
             float recall,
-            HashSourceState* hash_state
+            TFilter& filter
         ) const {
-            g_performance_metrics.start_timer(Computation::Sketching);
-            QuerySketches sketches = filterer.reset(query);
-            g_performance_metrics.store_time(Computation::Sketching);
+            auto& maxbuffer = ctx.maxbuffer;
+            auto& buffers = ctx.buffers;
 
             const size_t FILTER_BUFFER_SIZE = 128;
 
-            SearchBuffers buffers(lsh_maps, hash_state);
             // Buffer for values passing filtering and should have distances computed.
             // 8*RING_SIZE is necessary additional space as that is the maximum that can be added
             // between the last check of the size and it being emptied.
             uint32_t passing_filter[FILTER_BUFFER_SIZE+8*RING_SIZE];
+            // Number of candidates ahead whose vectors are prefetched, if the filter asks for it.
+            const static uint_fast32_t VECTOR_PREFETCH_DIST = 4;
 
             // foreach possible bit in hash
             for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
@@ -743,11 +1557,7 @@ namespace puffinn {
                         // This should be completely unrolled
                         for (int_fast32_t ring_idx=0; ring_idx < RING_SIZE; ring_idx++) {
                             auto prefetch_ring_idx = (ring_idx+PREFETCH_DIST)&(RING_SIZE-1);
-                            auto prefetch_segment = ring[prefetch_ring_idx];
-                            filterer.prefetch(prefetch_segment[0], prefetch_ring_idx);
-                            filterer.prefetch(prefetch_segment[1], prefetch_ring_idx);
-                            filterer.prefetch(prefetch_segment[2], prefetch_ring_idx);
-                            filterer.prefetch(prefetch_segment[3], prefetch_ring_idx);
+                            filter.prefetch(ring[prefetch_ring_idx], prefetch_ring_idx);
 
                             auto prereq_prefetch_segment =
                                 ring[(ring_idx+PREREQ_PREFETCH_DIST)&(RING_SIZE-1)];
@@ -756,32 +1566,9 @@ namespace puffinn {
                             prefetch_addr(&prereq_prefetch_segment[2]);
                             prefetch_addr(&prereq_prefetch_segment[3]);
 
-                            // indices
-                            auto v1 = ring[ring_idx][0];
-                            auto v2 = ring[ring_idx][1];
-                            auto v3 = ring[ring_idx][2];
-                            auto v4 = ring[ring_idx][3];
-
-                            // sketches
-                            auto s1 = filterer.get_sketch(v1, ring_idx);
-                            auto s2 = filterer.get_sketch(v2, ring_idx);
-                            auto s3 = filterer.get_sketch(v3, ring_idx);
-                            auto s4 = filterer.get_sketch(v4, ring_idx);
-
-                            // Whether they pass the filtering step
-                            auto p1 = sketches.passes_filter(s1, ring_idx);
-                            auto p2 = sketches.passes_filter(s2, ring_idx);
-                            auto p3 = sketches.passes_filter(s3, ring_idx);
-                            auto p4 = sketches.passes_filter(s4, ring_idx);
-
-                            passing_filter[num_passing_filter] = v1;
-                            num_passing_filter += p1;
-                            passing_filter[num_passing_filter] = v2;
-                            num_passing_filter += p2;
-                            passing_filter[num_passing_filter] = v3;
-                            num_passing_filter += p3;
-                            passing_filter[num_passing_filter] = v4;
-                            num_passing_filter += p4;
+                            // Filter the four values of the segment at once.
+                            num_passing_filter += filter.filter(
+                                ring[ring_idx], ring_idx, &passing_filter[num_passing_filter]);
 
                             // Put new query into the last slot
                             missing_ring_vals += (range_idx >= buffers.num_ranges);
@@ -796,12 +1583,7 @@ namespace puffinn {
                     // Can again add up to 4*RING_SIZE values to the buffer.
                     for (int_fast32_t ring_idx=RING_SIZE-1-missing_ring_vals; ring_idx >= 0; ring_idx--) {
                         auto prefetch_ring_idx = (ring_idx+PREFETCH_DIST)&(RING_SIZE-1);
-                        auto prefetch_segment = ring[prefetch_ring_idx];
-
-                        filterer.prefetch(prefetch_segment[0], prefetch_ring_idx);
-                        filterer.prefetch(prefetch_segment[1], prefetch_ring_idx);
-                        filterer.prefetch(prefetch_segment[2], prefetch_ring_idx);
-                        filterer.prefetch(prefetch_segment[3], prefetch_ring_idx);
+                        filter.prefetch(ring[prefetch_ring_idx], prefetch_ring_idx);
 
                         auto prereq_prefetch_segment =
                             ring[(ring_idx+PREREQ_PREFETCH_DIST)&(RING_SIZE-1)];
@@ -810,36 +1592,30 @@ namespace puffinn {
                         prefetch_addr(&prereq_prefetch_segment[2]);
                         prefetch_addr(&prereq_prefetch_segment[3]);
 
-                        auto v1 = ring[ring_idx][0];
-                        auto v2 = ring[ring_idx][1];
-                        auto v3 = ring[ring_idx][2];
-                        auto v4 = ring[ring_idx][3];
-
-                        auto p1 = sketches.passes_filter(v1, ring_idx);
-                        auto p2 = sketches.passes_filter(v2, ring_idx);
-                        auto p3 = sketches.passes_filter(v3, ring_idx);
-                        auto p4 = sketches.passes_filter(v4, ring_idx);
-
-                        passing_filter[num_passing_filter] = v1;
-                        num_passing_filter += p1;
-                        passing_filter[num_passing_filter] = v2;
-                        num_passing_filter += p2;
-                        passing_filter[num_passing_filter] = v3;
-                        num_passing_filter += p3;
-                        passing_filter[num_passing_filter] = v4;
-                        num_passing_filter += p4;
+                        num_passing_filter += filter.filter(
+                            ring[ring_idx], ring_idx, &passing_filter[num_passing_filter]);
                     }
                     g_performance_metrics.add_candidates(4*(RING_SIZE-missing_ring_vals));
 
                     // Empty buffer
                     g_performance_metrics.store_time(Computation::Filtering);
                     g_performance_metrics.start_timer(Computation::Consider);
+                    num_passing_filter = filter.select(passing_filter, num_passing_filter);
                     for (
                         uint_fast32_t passed_idx=0;
                         passed_idx < num_passing_filter;
                         passed_idx++
                     ) {
                         auto idx = passing_filter[passed_idx];
+                        if (
+                            filter.prefetch_vectors()
+                            && passed_idx+VECTOR_PREFETCH_DIST < num_passing_filter
+                        ) {
+                            prefetch_vector(passing_filter[passed_idx+VECTOR_PREFETCH_DIST]);
+                        }
+                        if (is_removed(idx)) {
+                            continue;
+                        }
                         auto dist = TSim::compute_similarity(
                             query,
                             dataset[idx],
@@ -849,7 +1625,7 @@ namespace puffinn {
                     g_performance_metrics.add_distance_computations(num_passing_filter);
                     num_passing_filter = 0;
                     auto kth_similarity = maxbuffer.smallest_value();
-                    sketches.max_sketch_diff = filterer.get_max_sketch_diff(kth_similarity);
+                    filter.update(kth_similarity);
                     g_performance_metrics.store_time(Computation::Consider);
 
                     // Stop if we have seen enough to be confident about the recall guarantee
@@ -875,6 +1651,211 @@ namespace puffinn {
             }
         }
 
+        // Search all maps and insert the candidates into the buffer.
+        void search_maps(
+            typename TSim::Format::Type* query,
+            SearchContext& ctx,
+            float recall
+        ) const {
+            SketchRingFilter filter{*this, ctx.sketches};
+            search_maps_ring(query, ctx, recall, filter);
+        }
+
+        // Filter a segment of four values by comparing their estimated inner products
+        // with the query to the limit.
+        uint_fast32_t filter_segment_pq(
+            const uint32_t* segment,
+            const int16_t* pq_distances,
+            int16_t limit,
+            uint32_t* out
+        ) const {
+            unsigned int mask =
+                (pq->estimatedInnerProduct(pq_distances, segment[0]) > limit)
+                | ((pq->estimatedInnerProduct(pq_distances, segment[1]) > limit) << 1)
+                | ((pq->estimatedInnerProduct(pq_distances, segment[2]) > limit) << 2)
+                | ((pq->estimatedInnerProduct(pq_distances, segment[3]) > limit) << 3);
+            return append_passing4(out, segment, mask);
+        }
+
+        // Search all maps like search_maps, but filter the candidates using product quantization.
+        void search_maps_pq(
+            typename TSim::Format::Type* query,
+            SearchContext& ctx,
+            float recall,
+            std::true_type
+        ) const {
+            g_performance_metrics.start_timer(Computation::Sketching);
+            ctx.pq_distances.resize(pq->getLookupTableSize());
+            pq->precomp_query_to_centroids(query, ctx.pq_distances.data());
+            g_performance_metrics.store_time(Computation::Sketching);
+
+            PQRingFilter filter{*this, ctx, ctx.pq_distances.data(), pq_rerank_factor != 0, 0};
+            filter.update(ctx.maxbuffer.smallest_value());
+            ctx.pq_deferred.clear();
+            search_maps_ring(query, ctx, recall, filter);
+            if (filter.rerank) {
+                score_deferred_pq_candidates(query, ctx);
+            }
+        }
+
+        // Product quantization is only used with cosine similarity, see make_pq_filter.
+        void search_maps_pq(typename TSim::Format::Type*, SearchContext&, float, std::false_type) const {}
+
+        // Keep the candidates that are among the best by their estimated similarity,
+        // ordered by their position in the dataset. Returns the number of kept candidates.
+        // The other candidates are deferred, see score_deferred_pq_candidates.
+        uint_fast32_t rank_pq_candidates(
+            uint32_t* candidates,
+            uint_fast32_t num_candidates,
+            const int16_t* pq_distances,
+            SearchContext& ctx
+        ) const {
+            uint_fast32_t num_kept = 0;
+            for (uint_fast32_t i=0; i < num_candidates; i++) {
+                auto idx = candidates[i];
+                if (is_removed(idx)) {
+                    continue;
+                }
+                auto estimate = pq->estimatedInnerProduct(pq_distances, idx);
+                auto estimated_sim = (UnitVectorFormat::from_16bit_fixed_point(estimate)+1)/2;
+                if (ctx.pq_candidates.insert(idx, estimated_sim)) {
+                    candidates[num_kept++] = idx;
+                } else {
+                    ctx.pq_deferred.push_back({ idx, estimate });
+                }
+            }
+            std::sort(candidates, candidates+num_kept);
+            return num_kept;
+        }
+
+        // Compute the similarity of the candidates deferred by rank_pq_candidates that can still
+        // be among the k best, which are those that pass the filter using the final k'th best value.
+        // Candidates are thus only discarded if they would also be discarded without re-ranking.
+        void score_deferred_pq_candidates(
+            typename TSim::Format::Type* query,
+            SearchContext& ctx
+        ) const {
+            g_performance_metrics.start_timer(Computation::Consider);
+            auto& deferred = ctx.pq_deferred;
+            auto limit = pq_limit(ctx.maxbuffer.smallest_value());
+            auto end = std::remove_if(deferred.begin(), deferred.end(),
+                [limit](const std::pair<uint32_t, int16_t>& c) { return c.second <= limit; });
+            // A candidate can be deferred once for each table it is found in.
+            std::sort(deferred.begin(), end);
+            end = std::unique(deferred.begin(), end);
+            const static size_t PREFETCH_DIST = 4;
+            size_t num_deferred = end-deferred.begin();
+            for (size_t i=0; i < num_deferred; i++) {
+                if (i+PREFETCH_DIST < num_deferred) {
+                    prefetch_vector(deferred[i+PREFETCH_DIST].first);
+                }
+                auto idx = deferred[i].first;
+                auto dist = TSim::compute_similarity(
+                    query,
+                    dataset[idx],
+                    dataset.get_description());
+                ctx.maxbuffer.insert(idx, dist);
+            }
+            g_performance_metrics.add_distance_computations(num_deferred);
+            g_performance_metrics.store_time(Computation::Consider);
+        }
+
+        // Fetch the vector of a value into cache before its similarity is computed.
+        void prefetch_vector(uint32_t idx) const {
+            const static size_t CACHE_LINE = 64;
+            auto vec = reinterpret_cast<const char*>(dataset[idx]);
+            size_t len = dataset.get_description().storage_len*sizeof(typename TSim::Format::Type);
+            for (size_t offset=0; offset < len; offset += CACHE_LINE) {
+                prefetch_addr(vec+offset);
+            }
+        }
+
+        // Search all maps using the sketches stored in each table.
+        // Since the sketches of a range are adjacent, no prefetching is necessary.
+        void search_maps_table_sketches(
+            typename TSim::Format::Type* query,
+            SearchContext& ctx,
+            float recall
+        ) const {
+            auto& maxbuffer = ctx.maxbuffer;
+            auto& sketches = ctx.sketches;
+            auto& buffers = ctx.buffers;
+
+            const size_t FILTER_BUFFER_SIZE = 128;
+            // Four values are always written when filtering a segment.
+            uint32_t passing_filter[FILTER_BUFFER_SIZE+4];
+
+            for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
+                buffers.fill_ranges(lsh_maps);
+                for (uint_fast32_t range_idx=0; range_idx < buffers.num_ranges; range_idx++) {
+                    g_performance_metrics.start_timer(Computation::Filtering);
+                    auto range = buffers.ranges[range_idx];
+                    size_t table_idx = buffers.table_indices[range_idx];
+                    auto sketch_idx = table_idx%NUM_SKETCHES;
+                    auto range_sketches = lsh_maps[table_idx].get_sketches(range.first);
+                    g_performance_metrics.add_candidates(range.second-range.first);
+
+                    // Ranges in uncompressed tables consist of segments of four values.
+                    while (range.first != range.second) {
+                        uint_fast32_t num_passing_filter = 0;
+                        while (num_passing_filter < FILTER_BUFFER_SIZE && range.first != range.second) {
+                            auto mask = sketches.passes_filter4(
+                                range_sketches[0],
+                                range_sketches[1],
+                                range_sketches[2],
+                                range_sketches[3],
+                                sketch_idx);
+                            num_passing_filter += append_passing4(
+                                &passing_filter[num_passing_filter], range.first, mask);
+                            range.first += 4;
+                            range_sketches += 4;
+                        }
+                        g_performance_metrics.store_time(Computation::Filtering);
+
+                        g_performance_metrics.start_timer(Computation::Consider);
+                        for (
+                            uint_fast32_t passed_idx=0;
+                            passed_idx < num_passing_filter;
+                            passed_idx++
+                        ) {
+                            auto idx = passing_filter[passed_idx];
+                            if (is_removed(idx)) {
+                                continue;
+                            }
+                            auto dist = TSim::compute_similarity(
+                                query,
+                                dataset[idx],
+                                dataset.get_description());
+                            maxbuffer.insert(idx, dist);
+                        }
+                        g_performance_metrics.add_distance_computations(num_passing_filter);
+                        sketches.max_sketch_diff =
+                            filterer.get_max_sketch_diff(maxbuffer.smallest_value());
+                        g_performance_metrics.store_time(Computation::Consider);
+                        g_performance_metrics.start_timer(Computation::Filtering);
+                    }
+                    g_performance_metrics.store_time(Computation::Filtering);
+
+                    // Stop if we have seen enough to be confident about the recall guarantee
+                    g_performance_metrics.start_timer(Computation::CheckTermination);
+                    auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
+                    float failure_prob = hash_source->failure_probability(
+                        depth,
+                        table_idx,
+                        last_tables,
+                        maxbuffer.smallest_value()
+                    );
+                    g_performance_metrics.store_time(Computation::CheckTermination);
+                    if (failure_prob <= 1-recall) {
+                        g_performance_metrics.set_hash_length(depth);
+                        g_performance_metrics.set_considered_maps(
+                            (MAX_HASHBITS-depth)*lsh_maps.size()+table_idx);
+                        return;
+                    }
+                }
+            }
+        }
+
         void serialize_chunk(std::ostream& out, size_t idx) const {
             lsh_maps[idx].serialize(out);
         }
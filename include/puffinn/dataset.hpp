@@ -3,14 +3,19 @@
 #include "puffinn/format/generic.hpp"
 #include "puffinn/typedefs.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <istream>
 #include <memory>
 #include <ostream>
+#include <type_traits>
+#include <vector>
 
 namespace puffinn {
     const unsigned int DEFAULT_CAPACITY = 100;
     const float EXPANSION_FACTOR = 1.5;
+    // Used in place of a new index for values that are removed when compacting.
+    const uint32_t REMOVED_INDEX = 0xffffffff;
 
     // The container for all inserted vectors.
     // The data is stored according to the given format.
@@ -81,19 +86,14 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(&storage_len), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&inserted_vectors), sizeof(unsigned int));
             capacity = inserted_vectors;
-            data = allocate_storage<T>(capacity, storage_len);
-            for (size_t i=0; i < inserted_vectors*storage_len; i++) {
-                T::deserialize_type(in, &data.get()[i]);
-            }
+            deserialize_values(in, std::is_trivially_copyable<typename T::Type>());
         }
 
         void serialize(std::ostream& out) const {
             T::serialize_args(out, args);
             out.write(reinterpret_cast<const char*>(&storage_len), sizeof(unsigned int));
             out.write(reinterpret_cast<const char*>(&inserted_vectors), sizeof(unsigned int));
-            for (size_t i=0; i < inserted_vectors*storage_len; i++) {
-                T::serialize_type(out, data.get()[i]);
-            }
+            serialize_values(out, std::is_trivially_copyable<typename T::Type>());
         }
 
         // Access the vector at the given position.
@@ -139,6 +139,29 @@ namespace puffinn {
             return capacity;
         }
 
+        // Remove vectors and move the remaining ones to their new indices.
+        // new_indices[idx] is the new index of the vector with index idx,
+        // or REMOVED_INDEX if it is removed.
+        // The remaining vectors must keep their relative order.
+        void compact(const std::vector<uint32_t>& new_indices) {
+            unsigned int len = 0;
+            for (unsigned int idx=0; idx < inserted_vectors; idx++) {
+                auto new_idx = new_indices[idx];
+                if (new_idx == REMOVED_INDEX) {
+                    continue;
+                }
+                if (new_idx != idx) {
+                    auto src = (*this)[idx];
+                    auto dst = (*this)[new_idx];
+                    for (size_t i=0; i < storage_len; i++) {
+                        dst[i] = std::move(src[i]);
+                    }
+                }
+                len++;
+            }
+            inserted_vectors = len;
+        }
+
         // Remove all points from the dataset.
         void clear() {
             inserted_vectors = 0;
@@ -153,5 +176,48 @@ namespace puffinn {
                 + capacity*storage_len*sizeof(typename T::Type)
                 + inner_memory;
         }
+
+    private:
+        // Values that can be copied bytewise are stored as a single section, which is referenced
+        // directly when reading from a mapped file. Inserting afterwards copies the data as the
+        // capacity is exceeded.
+        void deserialize_values(std::istream& in, std::true_type) {
+            size_t len = static_cast<size_t>(inserted_vectors)*storage_len;
+            std::shared_ptr<MappedFile> file;
+            char* mapped = map_section(
+                in,
+                len*sizeof(typename T::Type),
+                std::max<size_t>(T::ALIGNMENT, alignof(typename T::Type)),
+                file);
+            if (mapped != nullptr && capacity != 0) {
+                data = AlignedStorage<T>(
+                    reinterpret_cast<typename T::Type*>(mapped),
+                    len,
+                    file);
+                return;
+            }
+            capacity = std::max(capacity, 1u);
+            data = allocate_storage<T>(capacity, storage_len);
+            in.read(reinterpret_cast<char*>(data.get()), len*sizeof(typename T::Type));
+        }
+
+        // Other values are read by the format.
+        void deserialize_values(std::istream& in, std::false_type) {
+            size_t len = static_cast<size_t>(inserted_vectors)*storage_len;
+            capacity = std::max(capacity, 1u);
+            data = allocate_storage<T>(capacity, storage_len);
+            T::deserialize_values(in, data.get(), len);
+        }
+
+        void serialize_values(std::ostream& out, std::true_type) const {
+            size_t len = static_cast<size_t>(inserted_vectors)*storage_len;
+            write_section_padding(out);
+            out.write(reinterpret_cast<const char*>(data.get()), len*sizeof(typename T::Type));
+        }
+
+        void serialize_values(std::ostream& out, std::false_type) const {
+            size_t len = static_cast<size_t>(inserted_vectors)*storage_len;
+            T::serialize_values(out, data.get(), len);
+        }
     };
 }
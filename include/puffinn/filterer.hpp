@@ -4,41 +4,168 @@
 #include "puffinn/typedefs.hpp"
 #include "puffinn/hash_source/deserialize.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/hash_source/independent.hpp"
+#include "puffinn/hash/simhash.hpp"
+#include "puffinn/mmap.hpp"
 #include "puffinn/performance.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <immintrin.h>
 #include <memory>
+#include <stdexcept>
+#include <type_traits>
 
 namespace puffinn {
     const size_t NUM_SKETCHES = 32;
     const size_t LOG_NUM_SKETCHES = 5;
 
+    /// The number and width of the sketches used to filter candidates.
+    ///
+    /// Every value stores ``NumSketches`` sketches of ``8*sizeof(TWord)`` bits each.
+    /// Fewer or narrower sketches use less memory, which leaves more memory for hash tables,
+    /// but fewer candidates are filtered away.
+    ///
+    /// @param TWord The unsigned integer type used to store a sketch.
+    /// ``uint16_t``, ``uint32_t`` and ``uint64_t`` are supported.
+    /// @param NumSketches The number of sketches per value. Must be a power of two between 8 and 64.
+    template <typename TWord = FilterLshDatatype, unsigned int NumSketches = NUM_SKETCHES>
+    struct SketchParams {
+        using Word = TWord;
+        const static unsigned int NUM_SKETCHES = NumSketches;
+        const static unsigned int LOG_NUM_SKETCHES =
+            NumSketches == 8 ? 3 : NumSketches == 16 ? 4 : NumSketches == 32 ? 5 : 6;
+        // Number of bits in each sketch.
+        const static unsigned int BITS = 8*sizeof(TWord);
+
+        static_assert(
+            std::is_same<TWord, uint16_t>::value
+            || std::is_same<TWord, uint32_t>::value
+            || std::is_same<TWord, uint64_t>::value,
+            "Unsupported sketch type");
+        static_assert(
+            (1u << LOG_NUM_SKETCHES) == NumSketches,
+            "The number of sketches must be a power of two between 8 and 64");
+    };
+
     // Sketches for a single query.
+    template <typename P = SketchParams<>>
     struct QuerySketches {
+        using Word = typename P::Word;
+
         // Sketches for the current query.
-        std::vector<FilterLshDatatype> query_sketches;
+        std::vector<Word> query_sketches;
         // Max hamming distance between sketches to be considered in the current query.
         uint_fast8_t max_sketch_diff;
 
         // Check if the value at position idx in the dataset passes the next filter.
         // A value can only pass one filter.
-        bool passes_filter(FilterLshDatatype sketch, int_fast32_t sketch_idx) const {
+        bool passes_filter(Word sketch, int_fast32_t sketch_idx) const {
             uint_fast8_t sketch_diff = popcountll(sketch ^ query_sketches[sketch_idx]);
             return (sketch_diff <= max_sketch_diff);
         }
+
+        // Check which of four values pass the filter at the same sketch index.
+        // Bit i of the result is set if the i'th value passes.
+        // Narrower sketches are zero-extended to 64 bits.
+        unsigned int passes_filter4(
+            Word s1,
+            Word s2,
+            Word s3,
+            Word s4,
+            int_fast32_t sketch_idx
+        ) const {
+        #ifdef __AVX2__
+            __m256i diff = _mm256_xor_si256(
+                _mm256_setr_epi64x(s1, s2, s3, s4),
+                _mm256_set1_epi64x(query_sketches[sketch_idx]));
+            #if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+                __m256i counts = _mm256_popcnt_epi64(diff);
+            #else
+                // Count the bits of each nibble using a lookup table and sum the bytes of each value.
+                const __m256i lookup = _mm256_setr_epi8(
+                    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+                const __m256i low_mask = _mm256_set1_epi8(0x0f);
+                __m256i low = _mm256_and_si256(diff, low_mask);
+                __m256i high = _mm256_and_si256(_mm256_srli_epi16(diff, 4), low_mask);
+                __m256i counts = _mm256_sad_epu8(
+                    _mm256_add_epi8(
+                        _mm256_shuffle_epi8(lookup, low),
+                        _mm256_shuffle_epi8(lookup, high)),
+                    _mm256_setzero_si256());
+            #endif
+            __m256i failing = _mm256_cmpgt_epi64(counts, _mm256_set1_epi64x(max_sketch_diff));
+            return ~_mm256_movemask_pd(_mm256_castsi256_pd(failing)) & 0xf;
+        #else
+            return passes_filter(s1, sketch_idx)
+                | (passes_filter(s2, sketch_idx) << 1)
+                | (passes_filter(s3, sketch_idx) << 2)
+                | (passes_filter(s4, sketch_idx) << 3);
+        #endif
+        }
     };
 
-    template <typename T>
+    // Append the values in a segment of four whose bit is set in the mask to out.
+    // Four values are always written, so out needs room for at least four values.
+    // Returns the number of appended values.
+    unsigned int append_passing4(uint32_t* out, const uint32_t* values, unsigned int mask) {
+    #if defined(__AVX512F__) && defined(__AVX512VL__)
+        _mm_mask_compressstoreu_epi32(out, mask, _mm_loadu_si128((const __m128i*)values));
+    #elif defined(__SSSE3__)
+        // For every mask, the byte shuffle moving the selected values to the front.
+        alignas(16) static const uint8_t SHUFFLES[16][16] = {
+            {},
+            { 0, 1, 2, 3 },
+            { 4, 5, 6, 7 },
+            { 0, 1, 2, 3, 4, 5, 6, 7 },
+            { 8, 9, 10, 11 },
+            { 0, 1, 2, 3, 8, 9, 10, 11 },
+            { 4, 5, 6, 7, 8, 9, 10, 11 },
+            { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 },
+            { 12, 13, 14, 15 },
+            { 0, 1, 2, 3, 12, 13, 14, 15 },
+            { 4, 5, 6, 7, 12, 13, 14, 15 },
+            { 0, 1, 2, 3, 4, 5, 6, 7, 12, 13, 14, 15 },
+            { 8, 9, 10, 11, 12, 13, 14, 15 },
+            { 0, 1, 2, 3, 8, 9, 10, 11, 12, 13, 14, 15 },
+            { 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+            { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+        };
+        _mm_storeu_si128(
+            (__m128i*)out,
+            _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*)values),
+                _mm_load_si128((const __m128i*)SHUFFLES[mask])));
+    #else
+        unsigned int count = 0;
+        for (unsigned int i=0; i < 4; i++) {
+            out[count] = values[i];
+            count += (mask >> i) & 1;
+        }
+        return count;
+    #endif
+        return popcountll(mask);
+    }
+
+    template <typename T, typename P = SketchParams<>>
     class Filterer {
+        using Word = typename P::Word;
+        const static unsigned int NUM_SKETCHES = P::NUM_SKETCHES;
+        const static unsigned int LOG_NUM_SKETCHES = P::LOG_NUM_SKETCHES;
+
         std::unique_ptr<HashSource<T>> hash_source;
         // Filter hash functions
         std::vector<std::unique_ptr<Hash>> hash_functions;
 
         // Filters are stored with sketches for the same value adjacent.
-        std::vector<FilterLshDatatype> sketches;
+        MappableArray<Word> sketches;
         std::unique_ptr<HashSourceArgs<T>> sketch_args;
+        // Every bit of every sketch as one row, when the sketches are computed using
+        // independent SimHash functions. Empty otherwise.
+        // Row i*BITS+j computes bit j of sketch i.
+        SimHashMatrix sketch_matrix;
 
     public:
         Filterer(const HashSourceArgs<T>& args, DatasetDescription<typename T::Sim::Format> dataset)
@@ -46,81 +173,180 @@ namespace puffinn {
                 args.build(
                     dataset,
                     NUM_SKETCHES,
-                    NUM_FILTER_HASHBITS)),
+                    P::BITS)),
             sketch_args(args.copy())
         {
             for (size_t i=0; i<NUM_SKETCHES; i++) {
                 hash_functions.push_back(hash_source->sample());
             }
+            build_sketch_matrix();
         }
 
         Filterer(std::istream& in) {
+            unsigned int num_sketches, bits;
+            in.read(reinterpret_cast<char*>(&num_sketches), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&bits), sizeof(unsigned int));
+            if (num_sketches != NUM_SKETCHES || bits != P::BITS) {
+                throw std::invalid_argument("sketch parameters");
+            }
             sketch_args = deserialize_hash_args<T>(in);
             hash_source = sketch_args->deserialize_source(in);
             hash_functions.reserve(NUM_SKETCHES);
             for (size_t i=0; i < NUM_SKETCHES; i++) {
                 hash_functions.push_back(hash_source->deserialize_hash(in));
             }
-            size_t len;
-            in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
-            sketches.resize(len);
-            in.read(reinterpret_cast<char*>(sketches.data()), len*sizeof(FilterLshDatatype));
+            read_section(in, sketches);
+            build_sketch_matrix();
         }
 
         void serialize(std::ostream& out) const {
+            unsigned int num_sketches = NUM_SKETCHES;
+            unsigned int bits = P::BITS;
+            out.write(reinterpret_cast<const char*>(&num_sketches), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&bits), sizeof(unsigned int));
             sketch_args->serialize(out);
             hash_source->serialize(out);
             for (auto& h : hash_functions) {
                 h->serialize(out);
             }
-            size_t len = sketches.size();
-            out.write(reinterpret_cast<char*>(&len), sizeof(size_t));
-            out.write(reinterpret_cast<const char*>(sketches.data()), len*sizeof(FilterLshDatatype));
+            write_section(out, sketches.data(), sketches.size());
         }
 
         uint64_t memory_usage(DatasetDescription<typename T::Sim::Format> dataset) {
-            return sketch_args->memory_usage(dataset, NUM_SKETCHES, NUM_FILTER_HASHBITS)
-                + sketches.size()*sizeof(FilterLshDatatype)
-                + NUM_SKETCHES*sketch_args->function_memory_usage(dataset, NUM_FILTER_HASHBITS);
+            return sketch_args->memory_usage(dataset, NUM_SKETCHES, P::BITS)
+                + sketches.size()*sizeof(Word)
+                + NUM_SKETCHES*sketch_args->function_memory_usage(dataset, P::BITS)
+                + sketch_matrix.memory_usage();
         }
 
         void add_sketches(
             const Dataset<typename T::Sim::Format>& dataset,
             uint32_t first_index
         ) {
-            sketches.reserve(dataset.get_size()*NUM_SKETCHES);
+            sketches.resize(dataset.get_size()*NUM_SKETCHES);
 
+            // Each thread sketches a contiguous range of vectors.
+            #pragma omp parallel for schedule(static)
             for (size_t idx = first_index; idx < dataset.get_size(); idx++) {
-                auto state = hash_source->reset(dataset[idx], true);
-                for (size_t sketch_index = 0; sketch_index < NUM_SKETCHES; sketch_index++) {
-                    sketches.push_back((*hash_functions[sketch_index])(state.get()));
-                }
+                compute_sketches(dataset[idx], &sketches[idx << LOG_NUM_SKETCHES]);
             }
         }
 
-        QuerySketches reset(typename T::Sim::Format::Type* vec) const {
-            auto state = hash_source->reset(vec, false);
-
-            QuerySketches res;
-            res.query_sketches.reserve(NUM_SKETCHES);
-            for (size_t sketch_index=0; sketch_index<NUM_SKETCHES; sketch_index++) {
-                res.query_sketches.push_back((*hash_functions[sketch_index])(state.get()));
+        // Remove the sketches of removed values, see Dataset::compact.
+        void compact(const std::vector<uint32_t>& new_indices) {
+            size_t len = sketches.size() >> LOG_NUM_SKETCHES;
+            size_t new_len = 0;
+            for (size_t idx=0; idx < len; idx++) {
+                auto new_idx = new_indices[idx];
+                if (new_idx == REMOVED_INDEX) {
+                    continue;
+                }
+                if (new_idx != idx) {
+                    std::copy(
+                        sketches.begin()+(idx << LOG_NUM_SKETCHES),
+                        sketches.begin()+((idx+1) << LOG_NUM_SKETCHES),
+                        sketches.begin()+(static_cast<size_t>(new_idx) << LOG_NUM_SKETCHES));
+                }
+                new_len++;
             }
-            res.max_sketch_diff = NUM_FILTER_HASHBITS;
+            sketches.resize(new_len << LOG_NUM_SKETCHES);
+        }
+
+        QuerySketches<P> reset(typename T::Sim::Format::Type* vec) const {
+            QuerySketches<P> res;
+            reset(vec, res);
             return res;
         }
 
+        // Compute the sketches of a query into existing storage, reusing its memory.
+        void reset(typename T::Sim::Format::Type* vec, QuerySketches<P>& res) const {
+            res.query_sketches.resize(NUM_SKETCHES);
+            compute_sketches(vec, res.query_sketches.data());
+            res.max_sketch_diff = P::BITS;
+        }
+
+        // Retrieve the sketches of a value in the dataset as query sketches.
+        void reset_from_index(uint32_t idx, QuerySketches<P>& res) const {
+            res.query_sketches.assign(
+                sketches.begin()+(idx << LOG_NUM_SKETCHES),
+                sketches.begin()+((idx+1) << LOG_NUM_SKETCHES));
+            res.max_sketch_diff = P::BITS;
+        }
+
         void prefetch(uint32_t idx, int_fast32_t sketch_idx) const {
             prefetch_addr(&sketches[(idx << LOG_NUM_SKETCHES) | sketch_idx]);
         }
 
         uint_fast8_t get_max_sketch_diff(float min_dist) const {
             float collision_prob = hash_source->collision_probability(min_dist, 1);
-            return std::roundf(NUM_FILTER_HASHBITS*(1.0-collision_prob));
+            return std::roundf(P::BITS*(1.0-collision_prob));
         }
 
-        FilterLshDatatype get_sketch(uint32_t idx, int_fast32_t sketch_idx) const {
+        Word get_sketch(uint32_t idx, int_fast32_t sketch_idx) const {
             return sketches[(idx << LOG_NUM_SKETCHES) | sketch_idx];
         }
+
+    private:
+        void build_sketch_matrix() {
+            build_sketch_matrix(std::is_same<T, SimHash>());
+        }
+
+        // Only the bits of SimHash can be computed together as a matrix product.
+        void build_sketch_matrix(std::false_type) {}
+
+        void build_sketch_matrix(std::true_type) {
+            auto source = dynamic_cast<const IndependentHashSource<SimHash>*>(hash_source.get());
+            if (source == nullptr) {
+                return;
+            }
+            std::vector<const SimHashFunction*> rows;
+            rows.reserve(NUM_SKETCHES*P::BITS);
+            for (auto& h : hash_functions) {
+                auto first = static_cast<const IndependentHasher<SimHash>&>(*h).get_first_function();
+                // The first function of a hasher computes the most significant bit.
+                for (unsigned int bit=0; bit < P::BITS; bit++) {
+                    rows.push_back(&source->get_function(first+P::BITS-1-bit));
+                }
+            }
+            sketch_matrix = SimHashMatrix(rows);
+        }
+
+        // Compute all sketches of a vector into out.
+        void compute_sketches(typename T::Sim::Format::Type* vec, Word* out) const {
+            compute_sketches(vec, out, std::is_same<T, SimHash>());
+        }
+
+        void compute_sketches(
+            typename T::Sim::Format::Type* vec,
+            Word* out,
+            std::false_type
+        ) const {
+            auto state = hash_source->reset(vec, false);
+            for (size_t sketch_index=0; sketch_index < NUM_SKETCHES; sketch_index++) {
+                out[sketch_index] = static_cast<Word>((*hash_functions[sketch_index])(state.get()));
+            }
+        }
+
+        void compute_sketches(
+            typename T::Sim::Format::Type* vec,
+            Word* out,
+            std::true_type
+        ) const {
+            if (sketch_matrix.empty()) {
+                compute_sketches(vec, out, std::false_type());
+                return;
+            }
+            const unsigned int BLOCKS_PER_SKETCH = P::BITS/SimHashMatrix::ROWS_PER_BLOCK;
+            uint16_t blocks[NUM_SKETCHES*BLOCKS_PER_SKETCH];
+            sketch_matrix.hash(vec, blocks);
+            for (size_t sketch_index=0; sketch_index < NUM_SKETCHES; sketch_index++) {
+                Word sketch = 0;
+                for (unsigned int b=0; b < BLOCKS_PER_SKETCH; b++) {
+                    sketch |= static_cast<Word>(blocks[sketch_index*BLOCKS_PER_SKETCH+b])
+                        << (b*SimHashMatrix::ROWS_PER_BLOCK);
+                }
+                out[sketch_index] = sketch;
+            }
+        }
     };
 }
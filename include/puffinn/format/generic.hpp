@@ -1,5 +1,7 @@
 #pragma once
 
+#include "puffinn/mmap.hpp"
+
 #include <istream>
 #include <memory>
 #include <ostream>
@@ -40,16 +42,19 @@ namespace puffinn {
     }
 
     // Aligns data by allocating additional space.
+    // Can alternatively refer to already aligned data in a mapped file.
     template <typename T>
     class AlignedStorage {
         void* raw_mem;
         typename T::Type* aligned;
         size_t len;
+        std::shared_ptr<MappedFile> file;
 
         void reset() {
             raw_mem = nullptr;
             aligned = nullptr;
             len = 0;
+            file.reset();
         }
 
     public:
@@ -78,20 +83,31 @@ namespace puffinn {
             }
         }
 
+        // Refer to `len` values in a mapped file, which must be aligned.
+        AlignedStorage(typename T::Type* mapped, size_t len, std::shared_ptr<MappedFile> file)
+          : raw_mem(nullptr),
+            aligned(mapped),
+            len(len),
+            file(file)
+        {
+        }
+
         AlignedStorage(AlignedStorage&& other)
           : raw_mem(other.raw_mem),
             aligned(other.aligned),
-            len(other.len)
+            len(other.len),
+            file(std::move(other.file))
         {
             other.reset();
         }
 
+        // The previous contents are released when rhs is destroyed.
         AlignedStorage& operator=(AlignedStorage&& rhs) {
             if (this != &rhs) {
-                raw_mem = rhs.raw_mem;
-                aligned = rhs.aligned;
-                len = rhs.len;
-                rhs.reset();
+                std::swap(raw_mem, rhs.raw_mem);
+                std::swap(aligned, rhs.aligned);
+                std::swap(len, rhs.len);
+                file.swap(rhs.file);
             }
             return *this;
         }
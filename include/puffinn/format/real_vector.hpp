@@ -1,5 +1,7 @@
 #pragma once
 
+#include <istream>
+#include <ostream>
 #include <vector>
 
 #include "puffinn/format/generic.hpp"
@@ -34,6 +36,14 @@ namespace puffinn {
 
         static void free(Type&) {}
 
+        static void serialize_args(std::ostream& out, const Args& args) {
+            out.write(reinterpret_cast<const char*>(&args), sizeof(Args));
+        }
+
+        static void deserialize_args(std::istream& in, Args* args) {
+            in.read(reinterpret_cast<char*>(args), sizeof(Args));
+        }
+
 
         static float distance(const float* lhs, const float* rhs, unsigned int dimension)
         {
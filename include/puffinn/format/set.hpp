@@ -3,6 +3,7 @@
 #include <vector>
 #include <istream>
 #include <ostream>
+#include <stdexcept>
 
 #include "puffinn/format/generic.hpp"
 
@@ -75,23 +76,47 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(args), sizeof(Args));
         }
 
-        static void serialize_type(std::ostream& out, const Type& type) {
-            size_t len = type.size();
-            out.write(reinterpret_cast<char*>(&len), sizeof(size_t));
+        // Sets are serialized as an arena, which is the length of every set
+        // followed by the tokens of all sets.
+        // This allows the tokens to be read using a single read.
+        static void serialize_values(std::ostream& out, const Type* values, size_t len) {
+            std::vector<uint32_t> lengths(len);
+            size_t total_len = 0;
             for (size_t i=0; i < len; i++) {
-                out.write(reinterpret_cast<const char*>(&type[i]), sizeof(uint32_t));
+                lengths[i] = values[i].size();
+                total_len += values[i].size();
+            }
+            write_section(out, lengths.data(), len);
+
+            out.write(reinterpret_cast<const char*>(&total_len), sizeof(size_t));
+            write_section_padding(out);
+            for (size_t i=0; i < len; i++) {
+                out.write(
+                    reinterpret_cast<const char*>(values[i].data()),
+                    values[i].size()*sizeof(uint32_t));
             }
         }
 
-        static void deserialize_type(std::istream& in, Type* type) {
-            auto vec = new(type) std::vector<uint32_t>;
-            size_t len;
-            in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
-            vec->reserve(len);
+        // Read sets written by serialize_values into constructed storage.
+        static void deserialize_values(std::istream& in, Type* values, size_t len) {
+            MappableArray<uint32_t> lengths;
+            MappableArray<uint32_t> tokens;
+            read_section(in, lengths);
+            read_section(in, tokens);
+            if (!in || lengths.size() != len) {
+                throw std::invalid_argument("serialized set lengths");
+            }
+            size_t total_len = 0;
+            for (size_t i=0; i < len; i++) {
+                total_len += lengths[i];
+            }
+            if (total_len != tokens.size()) {
+                throw std::invalid_argument("serialized set tokens");
+            }
+            const uint32_t* set_start = tokens.data();
             for (size_t i=0; i < len; i++) {
-                uint32_t v;
-                in.read(reinterpret_cast<char*>(&v), sizeof(uint32_t));
-                vec->push_back(v);
+                values[i].assign(set_start, set_start+lengths[i]);
+                set_start += lengths[i];
             }
         }
     };
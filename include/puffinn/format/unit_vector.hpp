@@ -153,14 +153,6 @@ namespace puffinn {
         static void deserialize_args(std::istream& in, Args* args) {
             in.read(reinterpret_cast<char*>(args), sizeof(Args));
         }
-
-        static void serialize_type(std::ostream& out, const Type& type) {
-            out.write(reinterpret_cast<const char*>(&type), sizeof(Type));
-        }
-
-        static void deserialize_type(std::istream& in, Type* type) {
-            in.read(reinterpret_cast<char*>(type), sizeof(Type));
-        }
     };
 
     template <>
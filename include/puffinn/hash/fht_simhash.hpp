@@ -0,0 +1,342 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "external/ffht/fht_header_only.h"
+#include "puffinn/format/unit_vector.hpp"
+#include "puffinn/math.hpp"
+#include "puffinn/similarity_measure/cosine.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <numeric>
+#include <ostream>
+#include <vector>
+
+namespace puffinn {
+    // Pseudo-random rotation of a vector using random +-1 diagonal matrices and
+    // fast hadamard transforms, of which the signs of the first coordinates are used as hash bits.
+    class FHTSimHashFunction {
+        int dimensions;
+        int log_dimensions;
+        unsigned int num_rotations;
+        unsigned int num_bits;
+        // Random +-1 diagonal matrix for each rotation.
+        std::vector<int8_t> random_signs;
+
+    public:
+        FHTSimHashFunction(
+            DatasetDescription<UnitVectorFormat> dataset,
+            unsigned int num_rotations,
+            unsigned int num_bits
+        )
+          : dimensions(dataset.args),
+            num_rotations(num_rotations),
+            num_bits(num_bits)
+        {
+            log_dimensions = ceil_log(dimensions);
+
+            int random_signs_len = num_rotations*(1 << log_dimensions);
+            random_signs.reserve(random_signs_len);
+
+            std::uniform_int_distribution<int_fast32_t> sign_distribution(0, 1);
+            auto& generator = get_default_random_generator();
+            for (int i=0; i < random_signs_len; i++) {
+                random_signs.push_back(sign_distribution(generator)*2-1);
+            }
+        }
+
+        FHTSimHashFunction(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&dimensions), sizeof(int));
+            in.read(reinterpret_cast<char*>(&log_dimensions), sizeof(int));
+            in.read(reinterpret_cast<char*>(&num_rotations), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&num_bits), sizeof(unsigned int));
+
+            int signs_len = num_rotations*(1 << log_dimensions);
+            random_signs = std::vector<int8_t>(signs_len);
+            in.read(reinterpret_cast<char*>(&random_signs[0]), signs_len*sizeof(int8_t));
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&dimensions), sizeof(int));
+            out.write(reinterpret_cast<const char*>(&log_dimensions), sizeof(int));
+            out.write(reinterpret_cast<const char*>(&num_rotations), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&num_bits), sizeof(unsigned int));
+
+            out.write(reinterpret_cast<const char*>(&random_signs[0]), random_signs.size()*sizeof(int8_t));
+        }
+
+        // Hash a vector of floats, padded with zeros to a power of two.
+        // The vector is rotated in place.
+        LshDatatype hash_float(float* vec) const {
+            for (unsigned int rotation = 0; rotation < num_rotations; rotation++) {
+                // Multiply by a diagonal +-1 matrix.
+                int sign_idx = rotation*(1 << log_dimensions);
+                for (int i=0; i < (1 << log_dimensions); i++) {
+                    vec[i] *= random_signs[sign_idx+i];
+                }
+                // Apply the fast hadamard transform
+                fht(vec, log_dimensions);
+            }
+
+            LshDatatype res = 0;
+            for (unsigned int i=0; i < num_bits; i++) {
+                res = (res << 1) | (vec[i] >= 0.0f);
+            }
+            return res;
+        }
+
+        // Hash the given vector
+        LshDatatype operator()(int16_t* vec) const {
+            float rotated_vec[1 << log_dimensions];
+            for (int i=0; i<dimensions; i++) {
+                rotated_vec[i] = UnitVectorFormat::from_16bit_fixed_point(vec[i]);
+            }
+            for (int i=dimensions; i < (1 << log_dimensions); i++) {
+                rotated_vec[i] = 0.0f;
+            }
+            return hash_float(rotated_vec);
+        }
+    };
+
+    // Estimated collision probabilities of FHTSimHash for each number of bits.
+    //
+    // The bits of a pseudo-random rotation are not quite independent,
+    // so the probabilities are estimated by hashing pairs of vectors with a known similarity.
+    struct FHTSimHashCollisionEstimates {
+        std::vector<std::vector<float>> probabilities;
+        float eps;
+
+        FHTSimHashCollisionEstimates() {}
+
+        FHTSimHashCollisionEstimates(
+            DatasetDescription<UnitVectorFormat> dataset,
+            unsigned int num_rotations,
+            unsigned int num_bits,
+            unsigned int num_repetitions,
+            float eps
+        )
+          : eps(eps)
+        {
+            std::normal_distribution<float> standard_normal(0, 1);
+            auto& rng = get_default_random_generator();
+
+            unsigned int dimensions = dataset.args;
+            unsigned int padded_dimensions = 1 << ceil_log(dimensions);
+            unsigned int num_segments = 0;
+            for (double alpha = -1; alpha <= 1; alpha += 2*eps) {
+                num_segments++;
+            }
+            // Collisions for each number of used bits and each segment.
+            std::vector<std::vector<uint32_t>> collisions(
+                num_bits+1,
+                std::vector<uint32_t>(num_segments, 0));
+            // Number of compared groups of bits for each number of used bits.
+            std::vector<uint32_t> samples(num_bits+1, 0);
+
+            std::vector<float> x(padded_dimensions);
+            std::vector<float> z(padded_dimensions);
+            std::vector<float> y(padded_dimensions);
+            for (uint32_t rep = 0; rep < num_repetitions; rep++) {
+                FHTSimHashFunction function(dataset, num_rotations, num_bits);
+
+                for (unsigned int segment = 0; segment < num_segments; segment++) {
+                    // Random unit vectors x and z, with z orthogonal to x.
+                    std::fill(x.begin(), x.end(), 0.0f);
+                    std::fill(z.begin(), z.end(), 0.0f);
+                    for (unsigned int i=0; i < dimensions; i++) {
+                        x[i] = standard_normal(rng);
+                        z[i] = standard_normal(rng);
+                    }
+                    float x_norm = std::sqrt(std::inner_product(x.begin(), x.end(), x.begin(), 0.0f));
+                    for (auto& v : x) { v /= x_norm; }
+                    float overlap = std::inner_product(x.begin(), x.end(), z.begin(), 0.0f);
+                    for (unsigned int i=0; i < dimensions; i++) { z[i] -= overlap*x[i]; }
+                    float z_norm = std::sqrt(std::inner_product(z.begin(), z.end(), z.begin(), 0.0f));
+                    if (z_norm > 0) {
+                        for (auto& v : z) { v /= z_norm; }
+                    }
+
+                    // y has an inner product of alpha with x, which is in the middle of the segment
+                    // of similarities that the estimate is used for.
+                    double alpha = std::min(-1.0+2*eps*(segment+0.5), 1.0);
+                    double beta = std::sqrt(1-alpha*alpha);
+                    for (unsigned int i=0; i < padded_dimensions; i++) {
+                        y[i] = alpha*x[i]+beta*z[i];
+                    }
+                    // Hash the vectors as they are stored. Some rotated coordinates cancel out
+                    // exactly in the fixed point format, but not in floating point.
+                    for (unsigned int i=0; i < dimensions; i++) {
+                        x[i] = UnitVectorFormat::from_16bit_fixed_point(
+                            UnitVectorFormat::to_16bit_fixed_point(x[i]));
+                        y[i] = UnitVectorFormat::from_16bit_fixed_point(
+                            UnitVectorFormat::to_16bit_fixed_point(y[i]));
+                    }
+                    auto diff = function.hash_float(x.data()) ^ function.hash_float(y.data());
+                    // Every disjoint group of bits is a sample, starting with the most significant
+                    // bits, which are the ones kept when a hash is shortened.
+                    for (unsigned int used_bits = 1; used_bits <= num_bits; used_bits++) {
+                        auto mask = (1llu << used_bits)-1;
+                        for (unsigned int end = num_bits; end >= used_bits; end -= used_bits) {
+                            collisions[used_bits][segment] += ((diff >> (end-used_bits)) & mask) == 0;
+                        }
+                    }
+                }
+                for (unsigned int used_bits = 1; used_bits <= num_bits; used_bits++) {
+                    samples[used_bits] += num_bits/used_bits;
+                }
+            }
+
+            probabilities = std::vector<std::vector<float>>(num_bits+1);
+            for (unsigned int used_bits = 0; used_bits <= num_bits; used_bits++) {
+                for (unsigned int segment = 0; segment < num_segments; segment++) {
+                    float prob;
+                    if (used_bits != 0 && num_repetitions != 0) {
+                        prob = static_cast<float>(collisions[used_bits][segment])/samples[used_bits];
+                    } else {
+                        prob = 1.0;
+                    }
+                    probabilities[used_bits].push_back(prob);
+                }
+            }
+        }
+
+        FHTSimHashCollisionEstimates(std::istream& in) {
+            size_t d1;
+            in.read(reinterpret_cast<char*>(&d1), sizeof(size_t));
+
+            for (size_t i=0; i < d1; i++) {
+                size_t d2;
+                in.read(reinterpret_cast<char*>(&d2), sizeof(size_t));
+
+                probabilities.emplace_back(d2);
+                in.read(reinterpret_cast<char*>(&probabilities[i][0]), d2*sizeof(float));
+            }
+            in.read(reinterpret_cast<char*>(&eps), sizeof(float));
+        }
+
+        void serialize(std::ostream& out) const {
+            size_t d1 = probabilities.size();
+            out.write(reinterpret_cast<char*>(&d1), sizeof(size_t));
+
+            for (size_t i=0; i < d1; i++) {
+                size_t d2 = probabilities[i].size();
+                out.write(reinterpret_cast<char*>(&d2), sizeof(size_t));
+                out.write(reinterpret_cast<const char*>(&probabilities[i][0]), d2*sizeof(float));
+            }
+            out.write(reinterpret_cast<const char*>(&eps), sizeof(float));
+        }
+
+        float get_collision_probability(float sim, int_fast8_t num_bits) const {
+            auto& probs = probabilities[num_bits];
+            return probs[std::min(static_cast<size_t>(sim/eps), probs.size()-1)];
+        }
+    };
+
+    /// Arguments for the fast-hadamard SimHash.
+    struct FHTSimHashArgs {
+        /// Number of iterations of the fast-hadamard transform.
+        int num_rotations;
+        /// Number of samples used to estimate collision probabilities.
+        unsigned int estimation_repetitions;
+        /// Granularity of collision probability estimation.
+        float estimation_eps;
+
+        constexpr FHTSimHashArgs()
+            : num_rotations(3),
+              estimation_repetitions(1000),
+              estimation_eps(1e-2)
+        {
+        }
+
+        FHTSimHashArgs(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&num_rotations), sizeof(int));
+            in.read(reinterpret_cast<char*>(&estimation_repetitions), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&estimation_eps), sizeof(float));
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&num_rotations), sizeof(int));
+            out.write(reinterpret_cast<const char*>(&estimation_repetitions), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&estimation_eps), sizeof(float));
+        }
+
+        uint64_t memory_usage(DatasetDescription<UnitVectorFormat> dataset) const {
+            return sizeof(FHTSimHashFunction)
+            + num_rotations*(1 << ceil_log(dataset.args))*sizeof(int8_t);
+        }
+
+        void set_no_preprocessing() {
+            estimation_repetitions = 0;
+            estimation_eps = 2.0;
+        }
+    };
+
+    /// A structured alternative to ``SimHash`` using fast-hadamard transforms.
+    ///
+    /// Each function computes a pseudo-random rotation of the vector, in the same way as
+    /// ``FHTCrossPolytopeHash``, and uses the signs of the first coordinates as bits.
+    /// Each bit then behaves like a SimHash bit, but a function computes up to 32 bits
+    /// in ``O(d log d)`` time rather than ``O(d)`` time per bit.
+    /// This makes it a cheaper choice for sketches of high-dimensional vectors.
+    /// Since the bits are not fully independent, collision probabilities are estimated.
+    class FHTSimHash {
+    public:
+        using Args = FHTSimHashArgs;
+        using Sim = CosineSimilarity;
+        using Function = FHTSimHashFunction;
+
+    private:
+        DatasetDescription<UnitVectorFormat> dataset;
+        Args args;
+        FHTSimHashCollisionEstimates estimates;
+
+        static unsigned int function_bits(DatasetDescription<UnitVectorFormat> dataset) {
+            return std::min(8*sizeof(LshDatatype), static_cast<size_t>(1) << ceil_log(dataset.args));
+        }
+
+    public:
+        FHTSimHash(
+            DatasetDescription<UnitVectorFormat> dataset,
+            Args args
+        )
+          : dataset(dataset),
+            args(args),
+            estimates(
+                dataset,
+                args.num_rotations,
+                function_bits(dataset),
+                args.estimation_repetitions,
+                args.estimation_eps)
+        {
+        }
+
+        FHTSimHash(std::istream& in)
+          : dataset(in),
+            args(in),
+            estimates(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+            args.serialize(out);
+            estimates.serialize(out);
+        }
+
+        FHTSimHashFunction sample() {
+            return FHTSimHashFunction(dataset, args.num_rotations, bits_per_function());
+        }
+
+        unsigned int bits_per_function() {
+            return function_bits(dataset);
+        }
+
+        float collision_probability(
+            float similarity,
+            int_fast8_t num_bits
+        ) const {
+            return estimates.get_collision_probability(similarity, num_bits);
+        }
+    };
+}
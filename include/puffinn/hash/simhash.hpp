@@ -5,8 +5,10 @@
 #include "puffinn/math.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 
+#include <algorithm>
 #include <istream>
 #include <ostream>
+#include <vector>
 
 namespace puffinn {
     class SimHashFunction {
@@ -42,6 +44,123 @@ namespace puffinn {
             auto dot = dot_product_i16(hash_vec.get(), vec, dimensions);
             return dot >= UnitVectorFormat::to_16bit_fixed_point(0.0);
         }
+
+        // The normal vector of the hyperplane.
+        const int16_t* get_vector() const {
+            return hash_vec.get();
+        }
+
+        // Length of the stored vector, including padding.
+        unsigned int get_dimensions() const {
+            return dimensions;
+        }
+    };
+
+    // Many SimHash functions stored as the rows of one matrix, so that they can be
+    // evaluated together as a single matrix-vector product.
+    // The results are identical to evaluating each function separately.
+    class SimHashMatrix {
+        AlignedStorage<UnitVectorFormat> rows;
+        unsigned int dimensions = 0;
+        // Always a multiple of ROWS_PER_BLOCK.
+        size_t num_rows = 0;
+
+    public:
+        // Number of rows whose sign bits are computed together.
+        const static size_t ROWS_PER_BLOCK = 16;
+
+        SimHashMatrix() = default;
+
+        // Store the given functions as rows, padding with zero rows to a multiple of ROWS_PER_BLOCK.
+        // All functions must have the same dimensions.
+        SimHashMatrix(const std::vector<const SimHashFunction*>& functions)
+          : dimensions(functions.empty() ? 0 : functions[0]->get_dimensions()),
+            num_rows((functions.size()+ROWS_PER_BLOCK-1)/ROWS_PER_BLOCK*ROWS_PER_BLOCK)
+        {
+            rows = allocate_storage<UnitVectorFormat>(num_rows, dimensions);
+            std::fill(rows.get(), rows.get()+num_rows*dimensions, 0);
+            for (size_t row=0; row < functions.size(); row++) {
+                std::copy(
+                    functions[row]->get_vector(),
+                    functions[row]->get_vector()+dimensions,
+                    rows.get()+row*dimensions);
+            }
+        }
+
+        bool empty() const {
+            return num_rows == 0;
+        }
+
+        uint64_t memory_usage() const {
+            return sizeof(SimHashMatrix) + num_rows*dimensions*sizeof(int16_t);
+        }
+
+        // Hash the vector using every row.
+        // Bit j of out[b] is the hash of row b*ROWS_PER_BLOCK+j.
+        void hash(const int16_t* vec, uint16_t* out) const {
+            for (size_t block=0; block < num_rows/ROWS_PER_BLOCK; block++) {
+                out[block] = hash_block(vec, rows.get()+block*ROWS_PER_BLOCK*dimensions);
+            }
+        }
+
+    private:
+        uint16_t hash_block(const int16_t* vec, const int16_t* block) const {
+        #ifdef __AVX2__
+            // Accumulate the products of each row in the same way as dot_product_i16,
+            // but leave the lanes unsummed.
+            // Four rows are processed at a time so that each load of the vector is reused.
+            __m256i acc[ROWS_PER_BLOCK];
+            for (size_t row=0; row < ROWS_PER_BLOCK; row += 4) {
+                const int16_t* r0 = &block[row*dimensions];
+                const int16_t* r1 = r0+dimensions;
+                const int16_t* r2 = r1+dimensions;
+                const int16_t* r3 = r2+dimensions;
+                __m256i s0 = _mm256_setzero_si256();
+                __m256i s1 = _mm256_setzero_si256();
+                __m256i s2 = _mm256_setzero_si256();
+                __m256i s3 = _mm256_setzero_si256();
+                for (unsigned int i=0; i < dimensions; i += 16) {
+                    __m256i v = _mm256_load_si256((const __m256i*)&vec[i]);
+                    s0 = _mm256_add_epi16(s0, _mm256_mulhrs_epi16(_mm256_load_si256((const __m256i*)&r0[i]), v));
+                    s1 = _mm256_add_epi16(s1, _mm256_mulhrs_epi16(_mm256_load_si256((const __m256i*)&r1[i]), v));
+                    s2 = _mm256_add_epi16(s2, _mm256_mulhrs_epi16(_mm256_load_si256((const __m256i*)&r2[i]), v));
+                    s3 = _mm256_add_epi16(s3, _mm256_mulhrs_epi16(_mm256_load_si256((const __m256i*)&r3[i]), v));
+                }
+                acc[row] = s0;
+                acc[row+1] = s1;
+                acc[row+2] = s2;
+                acc[row+3] = s3;
+            }
+            // Sum the lanes of every row. Since the additions wrap around,
+            // the result is the same as when summing in any other order.
+            // Each 128-bit half of `low` and `high` contains the partial sums of rows 0-7 and 8-15.
+            __m256i sums[ROWS_PER_BLOCK/2];
+            for (size_t i=0; i < ROWS_PER_BLOCK/2; i++) {
+                sums[i] = _mm256_hadd_epi16(acc[2*i], acc[2*i+1]);
+            }
+            for (size_t i=0; i < ROWS_PER_BLOCK/4; i++) {
+                sums[i] = _mm256_hadd_epi16(sums[2*i], sums[2*i+1]);
+            }
+            __m256i low = _mm256_hadd_epi16(sums[0], sums[1]);
+            __m256i high = _mm256_hadd_epi16(sums[2], sums[3]);
+            __m256i dots = _mm256_add_epi16(
+                _mm256_permute2x128_si256(low, high, 0x20),
+                _mm256_permute2x128_si256(low, high, 0x31));
+            // Pack the sign bits of the 16 dot products.
+            __m256i non_negative = _mm256_cmpgt_epi16(dots, _mm256_set1_epi16(-1));
+            __m256i packed = _mm256_permute4x64_epi64(
+                _mm256_packs_epi16(non_negative, _mm256_setzero_si256()),
+                _MM_SHUFFLE(3, 1, 2, 0));
+            return _mm256_movemask_epi8(packed) & 0xffff;
+        #else
+            uint16_t res = 0;
+            for (size_t row=0; row < ROWS_PER_BLOCK; row++) {
+                auto dot = dot_product_i16(vec, &block[row*dimensions], dimensions);
+                res |= static_cast<uint16_t>(dot >= 0) << row;
+            }
+            return res;
+        #endif
+        }
     };
 
     /// ``SimHash`` does not take any arguments.
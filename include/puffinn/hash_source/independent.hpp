@@ -96,6 +96,11 @@ namespace puffinn {
             return state;
         }
 
+        // Retrieve one of the underlying functions of the hash family.
+        const typename T::Function& get_function(unsigned int idx) const {
+            return hash_functions[idx];
+        }
+
         // Retrieve the number of functions this source can create.
         size_t get_size() const {
             return hash_functions.size()/functions_per_hasher;
@@ -162,6 +167,11 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&first_function), sizeof(unsigned int));
         }
 
+        // Index in the source of the function that computes the most significant bits.
+        unsigned int get_first_function() const {
+            return first_function;
+        }
+
         uint64_t operator()(HashSourceState* state) const {
             auto independent_state = static_cast<IndependentHashSourceState<T>*>(state); 
             return source->hash(first_function, independent_state->hashed_vec);
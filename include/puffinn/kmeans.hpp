@@ -12,6 +12,9 @@
 #include <random>
 #include <unordered_set>
 #include <cfloat>
+#include <cmath>
+#include <limits>
+#include <numeric>
 
 #if defined(__AVX2__) || defined(__AVX__)
     #include <immintrin.h>
@@ -19,6 +22,9 @@
 
 namespace puffinn
 {
+    // Number of points whose distances are summed together when sampling centroids with kmeans++
+    const size_t KMEANS_PP_BLOCK = 1024;
+
     // The implementation of this class is highly inspired by: https://github.com/yahoojapan/NGT/blob/master/lib/NGT/Clustering.h
     /// Class for performing k-means clustering on a given dataset
     class KMeans
@@ -34,6 +40,10 @@ namespace puffinn
             }
         };
         enum distanceType {euclidean, mahalanobis, none};
+        /// How points are reassigned in each lloyd iteration.
+        /// plain compares every point to every centroid,
+        /// hamerly keeps bounds on the distances and skips points that cannot change cluster
+        enum iterationType {plain, hamerly};
         std::vector<float> covarianceMatrix; // Currently only public for testing purposes
     private:
 
@@ -46,6 +56,9 @@ namespace puffinn
         const uint16_t MAX_ITER;
         const unsigned int N_RUNS; // Perhaps not needed for final version
         distanceType MODE;
+        const iterationType ITERATION;
+        // Each instance has its own engine so that several can be fitted concurrently
+        std::default_random_engine rand_gen;
 
         // gb are the global best results
         // These will also be removed if N_RUNS is removed
@@ -60,16 +73,20 @@ namespace puffinn
         /// @param runs The number of times it tries to find optimal clusters, the final set of clusters is the best of all runs (default: 3)
         /// @param max_iter The number of llyod iteration to at most perform before terminating (default: 100)
         /// @param tol The minimum inertia difference before the algorithm is terminated
+        /// @param iteration How points are reassigned in each iteration. With hamerly, the iterations instead continue until no point changes cluster (default: plain)
         KMeans(unsigned int K_clusters = 256, distanceType mode = euclidean,
-            unsigned int runs = 3, unsigned int max_iter = 100, float tol = 0.001f)
+            unsigned int runs = 3, unsigned int max_iter = 100, float tol = 0.001f,
+            iterationType iteration = plain)
             : K(K_clusters),
             TOL(tol),
             MAX_ITER(max_iter),
             N_RUNS(runs),
-            MODE(mode)
+            MODE(mode),
+            ITERATION(iteration)
         {
             assert(K <= 256);
             assert(K > 0);
+            rand_gen.seed(get_default_random_generator()());
         }
 
         ~KMeans() {}
@@ -107,6 +124,24 @@ namespace puffinn
             }
         }
 
+        // Finds the label of the nearest fitted centroid of every point in data
+        // This allows fitting on a sample and then assigning the remaining points
+        std::vector<unsigned int> predict(dataType &data)
+        {
+        #if __AVX2__
+            padData(data);
+        #endif
+            std::vector<unsigned int> labels(data.size());
+        #if __AVX2__
+            if (MODE == euclidean) {
+                assignEuclidean_avx2(data, gb_clusters, labels);
+                return labels;
+            }
+        #endif
+            assignByDistance(data, gb_clusters, labels);
+            return labels;
+        }
+
         std::vector<unsigned int> getGBMembers(size_t c_i){
             return gb_clusters[c_i].members;
         } 
@@ -132,6 +167,9 @@ namespace puffinn
         // Performs a single kmeans clustering using the lloyd algorithm
         double lloyd(dataType &data, std::vector<Cluster> &clusters, unsigned int max_iter) 
         {
+            if (ITERATION == hamerly) {
+                return lloyd_hamerly(data, clusters, max_iter);
+            }
             double inertia_delta = DBL_MAX;
             double inertia = DBL_MAX;
             unsigned int iteration = 0;
@@ -141,7 +179,9 @@ namespace puffinn
                 // Step 1 in llyod: assign points to clusters
                 double current_inertia = assignToClusters(data, clusters);
                 // Step 2 in llyod: Set clusters to be center of points in cluster
+                // A cluster that lost all of its points keeps its previous centroid
                 for (auto cit = clusters.begin(); cit != clusters.end(); cit++) {
+                    if (cit->members.empty()) continue;
                 #if __AVX2__
                     setCentroidMean_avx2(data, *cit);
                 #else
@@ -158,6 +198,142 @@ namespace puffinn
 
         }
 
+        // Performs lloyd iterations using the bounds from Hamerly, "Making k-means even faster".
+        // Each point keeps an upper bound on the distance to its centroid and a lower bound on the distance
+        // to every other centroid. The point is only compared to all centroids when the bounds no longer
+        // guarantee that its nearest centroid is unchanged. The bounds rely on the triangle inequality,
+        // which holds for the square root of both distance types.
+        double lloyd_hamerly(dataType &data, std::vector<Cluster> &clusters, unsigned int max_iter)
+        {
+            const size_t N = data.size();
+            std::vector<unsigned int> labels(N), to_assign(N);
+            std::vector<double> upper(N), lower(N);
+            std::vector<double> shift(K), half_gap(K);
+            std::vector<uint8_t> bounds_failed(N);
+
+            std::iota(to_assign.begin(), to_assign.end(), 0u);
+            assignWithBounds(data, clusters, to_assign, labels, upper, lower);
+
+            size_t changed = N;
+            unsigned int iteration = 0;
+            while (changed > 0 && iteration < max_iter) {
+                fillMembers(clusters, labels);
+                // Move the centroids and record how far each of them moved
+                for (unsigned int c_i = 0; c_i < K; c_i++) {
+                    shift[c_i] = 0;
+                    if (clusters[c_i].members.empty()) continue;
+                    std::vector<float> previous = clusters[c_i].centroid;
+                #if __AVX2__
+                    setCentroidMean_avx2(data, clusters[c_i]);
+                #else
+                    setCentroidMean(data, clusters[c_i]);
+                #endif
+                    shift[c_i] = std::sqrt(std::max(distance(previous, clusters[c_i].centroid), 0.0));
+                }
+
+                // The lower bound of a point decreases by the largest shift among the other centroids
+                unsigned int max_label = std::max_element(shift.begin(), shift.end())-shift.begin();
+                double max_shift = shift[max_label], second_shift = 0;
+                for (unsigned int c_i = 0; c_i < K; c_i++) {
+                    if (c_i != max_label) second_shift = std::max(second_shift, shift[c_i]);
+                }
+
+                // A point closer to its centroid than half the distance to the nearest other centroid cannot move
+                std::fill(half_gap.begin(), half_gap.end(), DBL_MAX);
+                for (unsigned int c1 = 0; c1 < K; c1++) {
+                    for (unsigned int c2 = c1+1; c2 < K; c2++) {
+                        double d = 0.5*std::sqrt(std::max(distance(clusters[c1].centroid, clusters[c2].centroid), 0.0));
+                        half_gap[c1] = std::min(half_gap[c1], d);
+                        half_gap[c2] = std::min(half_gap[c2], d);
+                    }
+                }
+
+                #pragma omp parallel for schedule(static)
+                for (size_t i = 0; i < N; i++) {
+                    unsigned int label = labels[i];
+                    upper[i] += shift[label];
+                    lower[i] -= (label == max_label) ? second_shift : max_shift;
+                    double bound = std::max(half_gap[label], lower[i]);
+                    bounds_failed[i] = 0;
+                    if (upper[i] <= bound) continue;
+                    // Tighten the upper bound before comparing to every centroid
+                    upper[i] = std::sqrt(std::max(distance(data[i], clusters[label].centroid), 0.0));
+                    bounds_failed[i] = upper[i] > bound;
+                }
+                to_assign.clear();
+                for (unsigned int i = 0; i < N; i++) {
+                    if (bounds_failed[i]) to_assign.push_back(i);
+                }
+                changed = assignWithBounds(data, clusters, to_assign, labels, upper, lower);
+                iteration++;
+            }
+            fillMembers(clusters, labels);
+
+            double inertia = 0;
+            #pragma omp parallel for schedule(static) reduction(+:inertia)
+            for (size_t i = 0; i < N; i++) {
+                inertia += distance(data[i], clusters[labels[i]].centroid);
+            }
+            return inertia;
+        }
+
+        // Assigns the given points to their nearest centroid and sets their bounds exactly
+        // Returns the number of points that changed cluster
+        size_t assignWithBounds(
+            dataType &data, std::vector<Cluster> &clusters, const std::vector<unsigned int> &points,
+            std::vector<unsigned int> &labels, std::vector<double> &upper, std::vector<double> &lower
+        ) {
+            size_t changed = 0;
+            if (points.empty()) return changed;
+        #if __AVX2__
+            if (MODE == euclidean) {
+                TransposedCentroids centroids(clusters, K);
+                const size_t num_tiles = (points.size()+3)/4;
+                #pragma omp parallel for schedule(static) reduction(+:changed)
+                for (size_t tile = 0; tile < num_tiles; tile++) {
+                    const size_t first = tile*4;
+                    const unsigned int tile_len = std::min<size_t>(4, points.size()-first);
+                    const float *x[4];
+                    for (unsigned int j = 0; j < 4; j++) {
+                        x[j] = &data[points[first + std::min(j, tile_len-1)]][0];
+                    }
+                    unsigned int tile_labels[4];
+                    float best[4], second[4];
+                    nearestCentroids_avx2(x, tile_len, centroids, tile_labels, best, second);
+                    for (unsigned int j = 0; j < tile_len; j++) {
+                        unsigned int idx = points[first+j];
+                        changed += labels[idx] != tile_labels[j];
+                        labels[idx] = tile_labels[j];
+                        upper[idx] = std::sqrt(best[j]);
+                        lower[idx] = std::sqrt(second[j]);
+                    }
+                }
+                return changed;
+            }
+        #endif
+            #pragma omp parallel for schedule(static) reduction(+:changed)
+            for (size_t p = 0; p < points.size(); p++) {
+                unsigned int idx = points[p];
+                double best = DBL_MAX, second = DBL_MAX;
+                unsigned int best_label = 0;
+                for (unsigned int c_i = 0; c_i < K; c_i++) {
+                    double d = distance(data[idx], clusters[c_i].centroid);
+                    if (d < best) {
+                        second = best;
+                        best = d;
+                        best_label = c_i;
+                    } else if (d < second) {
+                        second = d;
+                    }
+                }
+                changed += labels[idx] != best_label;
+                labels[idx] = best_label;
+                upper[idx] = std::sqrt(std::max(best, 0.0));
+                lower[idx] = std::sqrt(std::max(second, 0.0));
+            }
+            return changed;
+        }
+
         // Creates the non-centered covariance matrix of data
         // Stores the matrix in the member covarianceMatrix
         // Build covariance matrix by covariance[i][j] = avg((v[i] * v[j])) over all v in dataset
@@ -179,19 +355,42 @@ namespace puffinn
         }
 
         // Assign all points to their cluster with the nearest centroid according to distance type
-        // Currently does not handle if any clusters are empty
+        // The labels are computed in parallel, after which the members are added in order
         double assignToClusters(dataType &data, std::vector<Cluster> &clusters)
+        {
+            std::vector<unsigned int> labels(data.size());
+        #if __AVX2__
+            double inertia = (MODE == euclidean)
+                ? assignEuclidean_avx2(data, clusters, labels)
+                : assignByDistance(data, clusters, labels);
+        #else
+            double inertia = assignByDistance(data, clusters, labels);
+        #endif
+
+            fillMembers(clusters, labels);
+            return inertia;
+        }
+
+        // Sets the members of each cluster from the label of every point
+        void fillMembers(std::vector<Cluster> &clusters, const std::vector<unsigned int> &labels)
         {
             // Clear member variable for each cluster
             for (auto cit = clusters.begin(); cit != clusters.end(); cit++) {
                 (*cit).members.clear();
             }
+            for (unsigned int i = 0; i < labels.size(); i++) {
+                clusters[labels[i]].members.push_back(i);
+            }
+        }
 
+        // Finds the nearest centroid of every point by computing the distance to each centroid
+        double assignByDistance(dataType &data, std::vector<Cluster> &clusters, std::vector<unsigned int> &labels)
+        {
             double inertia = 0;
-
-            for (unsigned int i = 0; i < data.size(); i++) {
+            #pragma omp parallel for schedule(static) reduction(+:inertia)
+            for (size_t i = 0; i < data.size(); i++) {
                 double min_dist = DBL_MAX;
-                unsigned int min_label = data.size() + 1;
+                unsigned int min_label = 0;
                 for (unsigned int c_i = 0; c_i < K; c_i++) {
                     double d = distance(data[i], clusters[c_i].centroid);
                     if (d < min_dist) {
@@ -199,7 +398,7 @@ namespace puffinn
                         min_dist = d;
                     }
                 }
-                clusters[min_label].members.push_back(i);
+                labels[i] = min_label;
                 inertia += min_dist;
             }
             return inertia;
@@ -225,7 +424,6 @@ namespace puffinn
         std::vector<Cluster> init_centroids_random(dataType &data)
         {
             std::vector<Cluster> clusters(K);
-            auto &rand_gen = get_default_random_generator();
             std::uniform_int_distribution<unsigned int> random_idx(0, data.size()-1);
 
             unsigned int c_i = 0;
@@ -242,29 +440,73 @@ namespace puffinn
         }
 
         // Kmeans++ initialization of centroids
+        // The distances are updated in parallel in blocks of KMEANS_PP_BLOCK points, whose sums are kept
+        // such that sampling a centroid only needs to scan the block sums and a single block
         std::vector<Cluster> init_centroids_kpp(dataType &data)
         {
+            const size_t N = data.size();
+            const size_t num_blocks = (N+KMEANS_PP_BLOCK-1)/KMEANS_PP_BLOCK;
             std::vector<Cluster> clusters(K);
             // Pick first centroids uniformly
-            auto &rand_gen = get_default_random_generator();
-            std::uniform_int_distribution<unsigned int> random_idx(0, data.size()-1);
+            std::uniform_int_distribution<unsigned int> random_idx(0, N-1);
             clusters[0].centroid = data[random_idx(rand_gen)];
 
             // Choose the rest proportional to their distance to already chosen centroids
-            std::vector<double> distances(data.size(), DBL_MAX);
+            std::vector<double> distances(N, DBL_MAX);
+            std::vector<double> block_sums(num_blocks);
             for (unsigned int c_i = 1; c_i < K; c_i++) {
                 // Calculate distances to last chosen centroid
-                for (unsigned int i = 0; i < data.size(); i++) {
-                    double new_dist = sumOfSquares(data[i], clusters[c_i-1].centroid);
-                    distances[i] = std::min(distances[i], new_dist);
+                std::vector<float> &last = clusters[c_i-1].centroid;
+                #pragma omp parallel for schedule(static)
+                for (size_t b = 0; b < num_blocks; b++) {
+                    double sum = 0;
+                    size_t end = std::min(N, (b+1)*KMEANS_PP_BLOCK);
+                    for (size_t i = b*KMEANS_PP_BLOCK; i < end; i++) {
+                    #if __AVX2__
+                        double new_dist = sumOfSquares_avx(data[i], last);
+                    #else
+                        double new_dist = sumOfSquares(data[i], last);
+                    #endif
+                        distances[i] = std::min(distances[i], new_dist);
+                        sum += distances[i];
+                    }
+                    block_sums[b] = sum;
                 }
-
-                std::discrete_distribution<int> rng(distances.begin(), distances.end());
-                clusters[c_i].centroid = data[rng(rand_gen)];
+                clusters[c_i].centroid = data[sampleByDistance(distances, block_sums)];
             }
             return clusters;
         }
 
+        // Samples a point with probability proportional to its distance, see init_centroids_kpp
+        size_t sampleByDistance(const std::vector<double> &distances, const std::vector<double> &block_sums)
+        {
+            double total = std::accumulate(block_sums.begin(), block_sums.end(), 0.0);
+            if (!(total > 0)) {
+                // Every point coincides with a chosen centroid
+                std::uniform_int_distribution<size_t> random_idx(0, distances.size()-1);
+                return random_idx(rand_gen);
+            }
+            double target = std::uniform_real_distribution<double>(0.0, total)(rand_gen);
+
+            // Rounding can make the target exceed the sums, in which case the last possible point is used
+            size_t block = 0;
+            for (size_t b = 0; b < block_sums.size(); b++) {
+                if (block_sums[b] <= 0) continue;
+                block = b;
+                if (target < block_sums[b]) break;
+                target -= block_sums[b];
+            }
+            size_t sample = 0;
+            size_t end = std::min(distances.size(), (block+1)*KMEANS_PP_BLOCK);
+            for (size_t i = block*KMEANS_PP_BLOCK; i < end; i++) {
+                if (distances[i] <= 0) continue;
+                sample = i;
+                if (target < distances[i]) break;
+                target -= distances[i];
+            }
+            return sample;
+        }
+
         // Calculates the distance between v1 and v2 according to the distance mode specified constructor
         double distance(std::vector<float> &v1, std::vector<float> &v2){
             if(MODE == euclidean){
@@ -398,6 +640,132 @@ namespace puffinn
             return s;
         }
 
+        // Centroids stored transposed, such that dimension d of 8 consecutive centroids can be loaded at once.
+        // Padding centroids have an infinite norm, so that they are never the nearest.
+        struct TransposedCentroids {
+            unsigned int dim, K_pad;
+            std::vector<float> values, norms;
+
+            TransposedCentroids(std::vector<Cluster> &clusters, unsigned int K)
+              : dim(clusters[0].centroid.size()),
+                // Number of centroids rounded up to a multiple of 8
+                K_pad((K+7)/8*8),
+                values(static_cast<size_t>(dim)*K_pad, 0.0f),
+                norms(K_pad, std::numeric_limits<float>::infinity())
+            {
+                for (unsigned int c_i = 0; c_i < K; c_i++) {
+                    float norm = 0.0f;
+                    for (unsigned int d = 0; d < dim; d++) {
+                        float v = clusters[c_i].centroid[d];
+                        values[static_cast<size_t>(d)*K_pad + c_i] = v;
+                        norm += v*v;
+                    }
+                    norms[c_i] = norm;
+                }
+            }
+        };
+
+        // Finds the nearest and second nearest centroid of a tile of 4 points using ||x||^2 - 2x.c + ||c||^2.
+        // The dot products are computed like a matrix product, where the tile is multiplied with
+        // 8 centroids at a time, such that every load of the centroids is shared by 4 points.
+        // Only the first tile_len entries of the output are set.
+        void nearestCentroids_avx2(
+            const float *x[4], unsigned int tile_len, const TransposedCentroids &centroids,
+            unsigned int *labels, float *best, float *second
+        ) {
+            const unsigned int dim = centroids.dim, K_pad = centroids.K_pad;
+            const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+            __m256 x_norm[4], best_dist[4], second_dist[4];
+            __m256i best_label[4];
+            for (unsigned int j = 0; j < 4; j++) {
+                float norm = 0.0f;
+                for (unsigned int d = 0; d < dim; d++) {
+                    norm += x[j][d]*x[j][d];
+                }
+                x_norm[j] = _mm256_set1_ps(norm);
+                best_dist[j] = inf;
+                second_dist[j] = inf;
+                best_label[j] = _mm256_setzero_si256();
+            }
+
+            const __m256 minus_two = _mm256_set1_ps(-2.0f);
+            __m256i labels_v = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i eight = _mm256_set1_epi32(8);
+            for (unsigned int c_i = 0; c_i < K_pad; c_i += 8) {
+                __m256 dot0 = _mm256_setzero_ps(), dot1 = _mm256_setzero_ps();
+                __m256 dot2 = _mm256_setzero_ps(), dot3 = _mm256_setzero_ps();
+                const float *c = &centroids.values[c_i];
+                for (unsigned int d = 0; d < dim; d++, c += K_pad) {
+                    __m256 cv = _mm256_loadu_ps(c);
+                    dot0 = _mm256_add_ps(dot0, _mm256_mul_ps(_mm256_set1_ps(x[0][d]), cv));
+                    dot1 = _mm256_add_ps(dot1, _mm256_mul_ps(_mm256_set1_ps(x[1][d]), cv));
+                    dot2 = _mm256_add_ps(dot2, _mm256_mul_ps(_mm256_set1_ps(x[2][d]), cv));
+                    dot3 = _mm256_add_ps(dot3, _mm256_mul_ps(_mm256_set1_ps(x[3][d]), cv));
+                }
+                __m256 c_norm = _mm256_loadu_ps(&centroids.norms[c_i]);
+                __m256 dots[4] = {dot0, dot1, dot2, dot3};
+                for (unsigned int j = 0; j < 4; j++) {
+                    __m256 dist = _mm256_add_ps(
+                        _mm256_add_ps(x_norm[j], c_norm),
+                        _mm256_mul_ps(minus_two, dots[j]));
+                    __m256 closer = _mm256_cmp_ps(dist, best_dist[j], _CMP_LT_OQ);
+                    second_dist[j] = _mm256_min_ps(second_dist[j], _mm256_max_ps(dist, best_dist[j]));
+                    best_dist[j] = _mm256_blendv_ps(best_dist[j], dist, closer);
+                    best_label[j] = _mm256_blendv_epi8(best_label[j], labels_v, _mm256_castps_si256(closer));
+                }
+                labels_v = _mm256_add_epi32(labels_v, eight);
+            }
+
+            for (unsigned int j = 0; j < tile_len; j++) {
+                alignas(32) float dist[8], dist2[8];
+                alignas(32) uint32_t label[8];
+                _mm256_store_ps(dist, best_dist[j]);
+                _mm256_store_ps(dist2, second_dist[j]);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(label), best_label[j]);
+                // Ties are broken by the lowest label, as when comparing the centroids in order
+                unsigned int min_lane = 0;
+                for (unsigned int lane = 1; lane < 8; lane++) {
+                    if (dist[lane] < dist[min_lane]
+                        || (dist[lane] == dist[min_lane] && label[lane] < label[min_lane])) {
+                        min_lane = lane;
+                    }
+                }
+                float second_min = dist2[min_lane];
+                for (unsigned int lane = 0; lane < 8; lane++) {
+                    if (lane != min_lane) second_min = std::min(second_min, dist[lane]);
+                }
+                labels[j] = label[min_lane];
+                // The decomposition can be slightly negative due to rounding
+                best[j] = std::max(dist[min_lane], 0.0f);
+                second[j] = std::max(second_min, 0.0f);
+            }
+        }
+
+        // Finds the nearest centroid of every point in parallel, see nearestCentroids_avx2
+        double assignEuclidean_avx2(dataType &data, std::vector<Cluster> &clusters, std::vector<unsigned int> &labels)
+        {
+            const size_t N = data.size();
+            TransposedCentroids centroids(clusters, K);
+            const size_t num_tiles = (N+3)/4;
+            double inertia = 0;
+            #pragma omp parallel for schedule(static) reduction(+:inertia)
+            for (size_t tile = 0; tile < num_tiles; tile++) {
+                const size_t first = tile*4;
+                const unsigned int tile_len = std::min<size_t>(4, N-first);
+                // The last tile repeats its final point to fill the tile
+                const float *x[4];
+                for (unsigned int j = 0; j < 4; j++) {
+                    x[j] = &data[first + std::min(j, tile_len-1)][0];
+                }
+                float best[4], second[4];
+                nearestCentroids_avx2(x, tile_len, centroids, &labels[first], best, second);
+                for (unsigned int j = 0; j < tile_len; j++) {
+                    inertia += best[j];
+                }
+            }
+            return inertia;
+        }
+
         void setCentroidMean_avx2(dataType &data, Cluster &c)
         {
             unsigned int n256 = data[0].size()/8;
@@ -424,8 +792,8 @@ namespace puffinn
 
         // Adds padding such that each vector is a multiple of 8
         void padData(dataType &data) {
-            padding = 8 - (data[0].size() % 8);
-            if (padding == 8) return; // Already correct size
+            padding = (8 - (data[0].size() % 8)) % 8;
+            if (padding == 0) return; // Already correct size
             for (std::vector<float> &vec : data) {
                 for (unsigned int p = 0; p < padding; p++) {
                     vec.push_back(0);
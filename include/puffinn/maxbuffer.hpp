@@ -15,7 +15,7 @@ namespace puffinn {
         using ResultPair = std::pair<uint32_t, float>;
 
     private:
-        const unsigned int size;
+        unsigned int size;
         unsigned int inserted_values;
         float minval;
         std::vector<ResultPair> data;
@@ -59,6 +59,15 @@ namespace puffinn {
             }
         }
 
+        // Remove all entries and change the number of stored elements to `k`.
+        // The allocated memory is reused when possible.
+        void reset(unsigned int k) {
+            size = k;
+            inserted_values = 0;
+            minval = (k == 0 ? 1.0 : 0.0);
+            data.resize(2*k);
+        }
+
         // Insert an index with an associated value into the buffer.
         // The buffer may choose to ignore it if it is not relevant.
         bool insert(uint32_t idx, float value) {
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define PUFFINN_HAS_MMAP
+#endif
+
+namespace puffinn {
+    // Alignment in bytes of the contents of serialized sections relative to the start of the stream.
+    const size_t SECTION_ALIGNMENT = 64;
+
+    // A file mapped into memory.
+    //
+    // The pages are mapped privately, so they are shared with the page cache until modified
+    // and changes are never written back to the file.
+    // On platforms without mmap, the file is read into memory instead.
+    class MappedFile {
+        char* addr = nullptr;
+        size_t len = 0;
+    #ifndef PUFFINN_HAS_MMAP
+        std::vector<char> contents;
+    #endif
+
+    public:
+        MappedFile(const std::string& path) {
+        #ifdef PUFFINN_HAS_MMAP
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1) {
+                throw std::invalid_argument("path");
+            }
+            struct stat st;
+            if (fstat(fd, &st) == -1) {
+                close(fd);
+                throw std::invalid_argument("path");
+            }
+            len = st.st_size;
+            if (len != 0) {
+                void* res = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (res == MAP_FAILED) {
+                    close(fd);
+                    throw std::invalid_argument("path");
+                }
+                addr = static_cast<char*>(res);
+            }
+            close(fd);
+        #else
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                throw std::invalid_argument("path");
+            }
+            contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            addr = contents.data();
+            len = contents.size();
+        #endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+        #ifdef PUFFINN_HAS_MMAP
+            if (addr != nullptr) {
+                munmap(addr, len);
+            }
+        #endif
+        }
+
+        char* data() const {
+            return addr;
+        }
+
+        size_t size() const {
+            return len;
+        }
+    };
+
+    // Stream buffer reading from a mapped file.
+    //
+    // Sections in the stream can be referenced directly instead of being copied.
+    class MappedStreambuf : public std::streambuf {
+        std::shared_ptr<MappedFile> file;
+
+    public:
+        MappedStreambuf(std::shared_ptr<MappedFile> file)
+          : file(file)
+        {
+            setg(file->data(), file->data(), file->data()+file->size());
+        }
+
+        std::shared_ptr<MappedFile> get_file() const {
+            return file;
+        }
+
+        // Reference the next `bytes` bytes and skip past them.
+        // Returns nullptr if they are not available or not aligned to the given number of bytes.
+        char* reference(size_t bytes, size_t alignment) {
+            char* pos = gptr();
+            if (
+                static_cast<size_t>(egptr()-pos) < bytes
+                || reinterpret_cast<uintptr_t>(pos)%alignment != 0
+            ) {
+                return nullptr;
+            }
+            setg(eback(), pos+bytes, egptr());
+            return pos;
+        }
+    };
+
+    /// An input stream over a file that is mapped into memory.
+    ///
+    /// When an ``Index`` is deserialized from this stream, its largest arrays refer
+    /// directly to the mapped file instead of being copied.
+    /// Several processes loading the same file therefore share a single copy in the page cache.
+    class MappedInputStream : public std::istream {
+        MappedStreambuf buf;
+
+    public:
+        MappedInputStream(const std::string& path)
+          : std::istream(nullptr),
+            buf(std::make_shared<MappedFile>(path))
+        {
+            rdbuf(&buf);
+        }
+
+        // Access the stream as an lvalue, which allows temporaries to be passed to deserializers.
+        std::istream& stream() {
+            return *this;
+        }
+    };
+
+    // A contiguous array that either owns its memory or refers to memory in a mapped file.
+    //
+    // Referenced memory can be modified without affecting the file,
+    // but changing the size copies the contents into owned memory.
+    template <typename T>
+    class MappableArray {
+        std::vector<T> owned;
+        std::shared_ptr<MappedFile> file;
+        T* ptr;
+        size_t len;
+
+        void refresh() {
+            ptr = owned.data();
+            len = owned.size();
+        }
+
+    public:
+        MappableArray() {
+            refresh();
+        }
+
+        explicit MappableArray(size_t len, const T& value = T())
+          : owned(len, value)
+        {
+            refresh();
+        }
+
+        MappableArray(std::vector<T>&& values)
+          : owned(std::move(values))
+        {
+            refresh();
+        }
+
+        // Copies are always stored in owned memory.
+        MappableArray(const MappableArray& other)
+          : owned(other.begin(), other.end())
+        {
+            refresh();
+        }
+
+        MappableArray(MappableArray&& other)
+          : owned(std::move(other.owned)),
+            file(std::move(other.file)),
+            ptr(other.ptr),
+            len(other.len)
+        {
+            other.refresh();
+        }
+
+        MappableArray& operator=(MappableArray other) {
+            owned.swap(other.owned);
+            file.swap(other.file);
+            std::swap(ptr, other.ptr);
+            std::swap(len, other.len);
+            return *this;
+        }
+
+        // Refer to `len` values in a mapped file.
+        void map(std::shared_ptr<MappedFile> mapped_file, T* values, size_t values_len) {
+            owned = std::vector<T>();
+            file = mapped_file;
+            ptr = values;
+            len = values_len;
+        }
+
+        bool is_mapped() const {
+            return file.get() != nullptr;
+        }
+
+        void resize(size_t new_len) {
+            if (file) {
+                std::vector<T> copy(ptr, ptr+std::min(len, new_len));
+                owned.swap(copy);
+                file.reset();
+            }
+            owned.resize(new_len);
+            refresh();
+        }
+
+        void assign(size_t new_len, const T& value) {
+            owned.assign(new_len, value);
+            file.reset();
+            refresh();
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+        bool empty() const {
+            return len == 0;
+        }
+
+        T* data() {
+            return ptr;
+        }
+
+        const T* data() const {
+            return ptr;
+        }
+
+        T& operator[](size_t idx) {
+            return ptr[idx];
+        }
+
+        const T& operator[](size_t idx) const {
+            return ptr[idx];
+        }
+
+        T* begin() {
+            return ptr;
+        }
+
+        const T* begin() const {
+            return ptr;
+        }
+
+        T* end() {
+            return ptr+len;
+        }
+
+        const T* end() const {
+            return ptr+len;
+        }
+    };
+
+    // Write the start of a section, which pads the stream so that the contents that follow
+    // are aligned relative to the start of the stream.
+    // If the position in the stream is unknown, no padding is used.
+    void write_section_padding(std::ostream& out) {
+        auto pos = out.tellp();
+        uint8_t padding = 0;
+        if (pos != std::streampos(-1)) {
+            padding = (SECTION_ALIGNMENT-(static_cast<size_t>(pos)+1)%SECTION_ALIGNMENT)%SECTION_ALIGNMENT;
+        }
+        char zeroes[SECTION_ALIGNMENT] = {0};
+        out.write(reinterpret_cast<const char*>(&padding), sizeof(uint8_t));
+        out.write(zeroes, padding);
+    }
+
+    // Skip the padding written by write_section_padding and try to reference the
+    // following `bytes` bytes in the mapped file that is being read.
+    // Returns nullptr if the stream is not a mapped file or the contents are not sufficiently
+    // aligned, in which case the contents should be read from the stream instead.
+    char* map_section(
+        std::istream& in,
+        size_t bytes,
+        size_t alignment,
+        std::shared_ptr<MappedFile>& file
+    ) {
+        uint8_t padding;
+        in.read(reinterpret_cast<char*>(&padding), sizeof(uint8_t));
+        in.ignore(padding);
+        auto mapped = dynamic_cast<MappedStreambuf*>(in.rdbuf());
+        if (mapped == nullptr || !in) {
+            return nullptr;
+        }
+        char* res = mapped->reference(bytes, alignment);
+        if (res != nullptr) {
+            file = mapped->get_file();
+        }
+        return res;
+    }
+
+    // Write an array as a length-prefixed section.
+    template <typename T>
+    void write_section(std::ostream& out, const T* values, size_t len) {
+        out.write(reinterpret_cast<const char*>(&len), sizeof(size_t));
+        write_section_padding(out);
+        if (len != 0) {
+            out.write(reinterpret_cast<const char*>(values), len*sizeof(T));
+        }
+    }
+
+    // Read a section written by write_section, referencing it if the stream is a mapped file.
+    template <typename T>
+    void read_section(std::istream& in, MappableArray<T>& arr) {
+        size_t len;
+        in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
+        std::shared_ptr<MappedFile> file;
+        char* mapped = map_section(in, len*sizeof(T), alignof(T), file);
+        if (mapped != nullptr) {
+            arr.map(file, reinterpret_cast<T*>(mapped), len);
+            return;
+        }
+        arr.assign(len, T());
+        if (len != 0) {
+            in.read(reinterpret_cast<char*>(arr.data()), len*sizeof(T));
+        }
+    }
+}
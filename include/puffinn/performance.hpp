@@ -40,6 +40,9 @@ namespace puffinn {
     };
 
     // A globally accessible structure to store performance metrics in.
+    // Each thread records into its own instance, so concurrent queries do not interfere.
+    // The parallel searches of an index merge the metrics of their threads into
+    // the instance of the calling thread, see merge.
     class PerformanceMetrics {
         std::vector<QueryMetrics> queries;
 
@@ -60,7 +63,6 @@ namespace puffinn {
             // Add an empty query so that methods can be called without starting a query.
             // This can happen in tests.
             queries.push_back(QueryMetrics());
-            new_query();
         }
 
         void new_query() {
@@ -93,6 +95,16 @@ namespace puffinn {
             }
         }
 
+        // Move the queries recorded by another instance to the end of this one.
+        void merge(PerformanceMetrics& other) {
+            if (&other == this) {
+                return;
+            }
+            queries.insert(queries.end(), other.queries.begin()+1, other.queries.end());
+            // Keep only the empty query, so that the moved queries are not merged again.
+            other.queries.resize(1);
+        }
+
         std::vector<QueryMetrics> get_query_metrics() const {
             std::vector<QueryMetrics> res;
             for (size_t i=1; i < queries.size(); i++) {
@@ -127,6 +139,6 @@ namespace puffinn {
         }
     };
 
-    PerformanceMetrics g_performance_metrics;
+    thread_local PerformanceMetrics g_performance_metrics;
 }
 
@@ -1,12 +1,41 @@
 #pragma once
 #include "puffinn/dataset.hpp"
 #include "puffinn/kmeans.hpp"
+#include "puffinn/maxbuffer.hpp"
 #include "math.h"
 #include <vector>
 #include <cfloat>
+#include <cmath>
+#include <immintrin.h>
 #include <iostream>
+#include <unordered_set>
+#include <numeric>
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
 namespace puffinn{
 
+    //Number of centroids per subspace when using fast-scan, such that every code fits in 4 bits
+    const unsigned int PQ_FAST_SCAN_CENTROIDS = 16;
+    //Number of points whose fast-scan codes are stored together and estimated at once, see PQFilter::packFastScanCode
+    const unsigned int PQ_FAST_SCAN_BLOCK = 32;
+    //Default number of training points per centroid, beyond which more points barely improve the codebook
+    const unsigned int PQ_TRAINING_POINTS_PER_CENTROID = 256;
+    //Number of points converted to floats at a time when encoding the dataset
+    const unsigned int PQ_ENCODE_CHUNK = 4096;
+    //Factor the dataset has to grow by since the codebook was trained before PQFilter::update retrains it
+    const unsigned int PQ_RETRAIN_GROWTH = 2;
+
+    //Lookup table of a query used to estimate inner products with fast-scan codes.
+    //The inner products with the centroids are quantized to 8 bits,
+    //such that the inner product with a point is approximately bias + scale*(sum of entries)
+    struct PQFastScanTable {
+        //16 entries for each subspace
+        std::vector<uint8_t> entries;
+        float scale = 1.0f;
+        int32_t bias = 0;
+    };
+
     class PQFilter{
         unsigned int M, dims;
         unsigned int K;
@@ -16,15 +45,23 @@ namespace puffinn{
         std::vector<Dataset<UnitVectorFormat>> codebook;
         //precomputed inter-centroid distances for faster symmetric distance computation
         std::vector<std::vector<std::vector<int16_t>>> centroidDistances;
-        //pointer to float array of M x K (flattened to 1d array)
-        int16_t *queryDistances;
-        std::vector<std::vector<uint8_t>> pqCodes;
+        //M codes per point, stored contiguously in the order of the dataset
+        std::vector<uint8_t> pqCodes;
         Dataset<UnitVectorFormat> &dataset;
         //meta information about the subspaces to avoid recomputation 
         std::vector<unsigned int> subspaceSizes, offsets = {0}, subspaceSizesStored;
+        //Maximum number of points the codebook is trained on, 0 means all points
+        unsigned int trainingSampleSize;
+        //Number of points in the dataset when the codebook was trained
+        unsigned int trainedSize = 0;
+        //Number of centroids fitted in each subspace, which is less than K when there are few points
+        unsigned int fittedCentroids = 0;
         bool is_build = false;
     public:
         float bootThreshold = 0.0f;
+        //How much the estimated inner product of a point is allowed to be below a limit
+        //for the point to still be considered, see bootStrapMargin
+        int16_t estimationMargin = 0;
         
         ///Builds short codes for vectors using Product Quantization by projecting every subspace down to neigherst kmeans cluster
         ///Uses these shortcodes for fast estimation of inner product between vectors  
@@ -38,7 +75,8 @@ namespace puffinn{
         dims(dataset.get_description().args),
         K(k),
         MODE(mode),
-        dataset(dataset)
+        dataset(dataset),
+        trainingSampleSize(k*PQ_TRAINING_POINTS_PER_CENTROID)
         {
             subspaceSizes.resize(M);
             assert(m%4 == 0);
@@ -47,29 +85,67 @@ namespace puffinn{
             for(auto i = subspaceSizes.begin(); i != subspaceSizes.begin()+leftover; i++) (*i)++;
             auto p = subspaceSizes.begin();
             for(unsigned int i = 1; i < M; i++) offsets.push_back(offsets.back()+ *p++);
-            queryDistances = new int16_t[K*M];
             LIM = K*M;
         }
 
-        ~PQFilter(){
-            delete[] queryDistances;
-        }
-
         //Builds the codebook and computes the inter-centroid-distances
         //Should be called every time the dataset significantly changes a d atleast once before querying
         void rebuild()
         {
             if (dataset.get_size() == 0){
                 is_build = false;
-                std::fill_n(queryDistances, K*M, 0);
                 return;
             } 
 
-            pqCodes.resize(dataset.get_size());
+            pqCodes.assign(static_cast<size_t>(dataset.get_size())*M, 0);
+            trainedSize = dataset.get_size();
             createCodebook();
             createDistanceTable();
             bootThreshold = bootStrapThreshold(100u, 5000u, 20u);
             is_build = true;
+            estimationMargin = bootStrapMargin(50u, 200u, 0.95f);
+        }
+
+        //Encodes the points inserted since the codes were last computed using the current codebook.
+        //The codebook is only retrained once the dataset has grown by PQ_RETRAIN_GROWTH since it was trained,
+        //so this is much cheaper than rebuild when few points were inserted.
+        void update()
+        {
+            if (!is_build || dataset.get_size() >= static_cast<uint64_t>(PQ_RETRAIN_GROWTH)*trainedSize) {
+                rebuild();
+                return;
+            }
+            size_t first = pqCodes.size()/M;
+            size_t size = dataset.get_size();
+            pqCodes.resize(size*M);
+            #pragma omp parallel for schedule(static)
+            for (size_t idx = first; idx < size; idx++) {
+                encode(dataset[idx], &pqCodes[idx*M]);
+            }
+        }
+
+        ///Set the maximum number of points that the codebook is trained on.
+        ///
+        ///A random sample of this size is clustered and every point is then encoded using the resulting centroids,
+        ///such that the training time and memory do not grow with the size of the dataset.
+        ///A size of 0 trains on every point. Defaults to 256 points per centroid.
+        ///This takes effect the next time ``rebuild`` is called.
+        void setTrainingSampleSize(unsigned int sampleSize) {
+            trainingSampleSize = sampleSize;
+        }
+
+        //Removes the codes of removed values, see Dataset::compact
+        void compact(const std::vector<uint32_t>& new_indices)
+        {
+            size_t len = 0;
+            for (size_t idx = 0; idx < pqCodes.size()/M; idx++) {
+                if (new_indices[idx] == REMOVED_INDEX) continue;
+                if (new_indices[idx] != idx) {
+                    std::copy_n(&pqCodes[idx*M], M, &pqCodes[static_cast<size_t>(new_indices[idx])*M]);
+                }
+                len++;
+            }
+            pqCodes.resize(len*M);
         }
 
         uint64_t memory_usage()
@@ -78,13 +154,121 @@ namespace puffinn{
             for (Dataset<UnitVectorFormat> &d : codebook){
                 cb_mem += d.memory_usage();
             }
-            return cb_mem + (pqCodes.size() * M * sizeof(uint8_t));
+            return cb_mem + (pqCodes.size() * sizeof(uint8_t));
         }    
 
+        //Pointer to the M codes of the point at index idx
+        const uint8_t* getCode(uint32_t idx) const {
+            return &pqCodes[static_cast<size_t>(idx)*M];
+        }
+
+        //Fetch the codes of a point into cache before they are used by estimatedInnerProduct
+        void prefetch(uint32_t idx) const {
+            prefetch_addr(getCode(idx));
+        }
+
+        //Whether the codes are small enough to use fast-scan estimation
+        bool fastScanEnabled() const {
+            return K == PQ_FAST_SCAN_CENTROIDS;
+        }
+
+        //Number of bytes in a fast-scan block, which stores the 4-bit codes of PQ_FAST_SCAN_BLOCK points
+        unsigned int getFastScanBlockSize() const {
+            return M*PQ_FAST_SCAN_BLOCK/2;
+        }
+
+        //Writes the code of a point into position j of a zeroed fast-scan block of PQ_FAST_SCAN_BLOCK points.
+        //For each subspace m, a block contains 16 bytes where byte j holds the code of point j
+        //in the low nibble and the code of point j+16 in the high nibble.
+        void packFastScanCode(uint8_t *block, unsigned int j, const uint8_t *code) const {
+            const unsigned int numSubspaces = M;
+            unsigned int shift = j < 16 ? 0 : 4;
+            uint8_t *dst = block + j%16;
+            for(unsigned int m = 0; m < numSubspaces; m++){
+                dst[m*16] |= code[m] << shift;
+            }
+        }
+
+        //Fills the quantized lookup table used by estimatedInnerProducts
+        //The inner products with the centroids are written to distances, which holds getLookupTableSize entries
+        void precompFastScanTable(typename UnitVectorFormat::Type* y, int16_t *distances, PQFastScanTable &table) const {
+            precomp_query_to_centroids(y, distances);
+            //A shared scale allows the entries of all subspaces to be summed before rescaling
+            int32_t maxRange = 0;
+            table.bias = 0;
+            for(unsigned int m = 0; m < M; m++){
+                auto minmax = std::minmax_element(distances+m*K, distances+(m+1)*K);
+                maxRange = std::max(maxRange, *minmax.second-*minmax.first);
+                table.bias += *minmax.first;
+            }
+            table.scale = maxRange == 0 ? 1.0f : maxRange/255.0f;
+            table.entries.resize(M*16);
+            for(unsigned int m = 0; m < M; m++){
+                int16_t minDist = *std::min_element(distances+m*K, distances+(m+1)*K);
+                for(unsigned int k = 0; k < PQ_FAST_SCAN_CENTROIDS; k++){
+                    table.entries[m*16+k] = std::lround((distances[m*K+k]-minDist)/table.scale);
+                }
+            }
+        }
+
+        //Estimates the inner products of a query with all points of a fast-scan block
+        void estimatedInnerProducts(const PQFastScanTable &table, const uint8_t *block, int16_t *out) const {
+            const uint8_t *lut = table.entries.data();
+        #if __AVX2__
+            //Two subspaces are processed at a time, one in each 128-bit lane
+            const __m256i lowMask = _mm256_set1_epi8(0x0f);
+            __m256i acc[4] = {
+                _mm256_setzero_si256(), _mm256_setzero_si256(),
+                _mm256_setzero_si256(), _mm256_setzero_si256()};
+            for(unsigned int m = 0; m < M; m += 2){
+                __m256i codes = _mm256_loadu_si256((const __m256i*)&block[m*16]);
+                __m256i entries = _mm256_loadu_si256((const __m256i*)&lut[m*16]);
+                __m256i low = _mm256_shuffle_epi8(entries, _mm256_and_si256(codes, lowMask));
+                __m256i high = _mm256_shuffle_epi8(entries, _mm256_and_si256(_mm256_srli_epi16(codes, 4), lowMask));
+                acc[0] = _mm256_add_epi16(acc[0], _mm256_unpacklo_epi8(low, _mm256_setzero_si256()));
+                acc[1] = _mm256_add_epi16(acc[1], _mm256_unpackhi_epi8(low, _mm256_setzero_si256()));
+                acc[2] = _mm256_add_epi16(acc[2], _mm256_unpacklo_epi8(high, _mm256_setzero_si256()));
+                acc[3] = _mm256_add_epi16(acc[3], _mm256_unpackhi_epi8(high, _mm256_setzero_si256()));
+            }
+            //Each group of 8 points is summed over the two lanes and rescaled
+            const __m256 scale = _mm256_set1_ps(table.scale);
+            const __m256i bias = _mm256_set1_epi32(table.bias);
+            for(unsigned int i = 0; i < 4; i += 2){
+                __m256i estimates[2];
+                for(unsigned int h = 0; h < 2; h++){
+                    __m128i sum = _mm_add_epi16(
+                        _mm256_castsi256_si128(acc[i+h]),
+                        _mm256_extracti128_si256(acc[i+h], 1));
+                    __m256 scaled = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(sum)), scale);
+                    estimates[h] = _mm256_add_epi32(_mm256_cvtps_epi32(scaled), bias);
+                }
+                //Saturate to 16 bits and undo the lane interleaving of packs
+                __m256i packed = _mm256_permute4x64_epi64(
+                    _mm256_packs_epi32(estimates[0], estimates[1]),
+                    _MM_SHUFFLE(3, 1, 2, 0));
+                _mm256_storeu_si256((__m256i*)&out[8*i], packed);
+            }
+        #else
+            uint16_t sums[PQ_FAST_SCAN_BLOCK] = {0};
+            for(unsigned int m = 0; m < M; m++){
+                for(unsigned int j = 0; j < 16; j++){
+                    uint8_t codes = block[m*16+j];
+                    sums[j] += lut[m*16 + (codes & 0x0f)];
+                    sums[j+16] += lut[m*16 + (codes >> 4)];
+                }
+            }
+            for(unsigned int j = 0; j < PQ_FAST_SCAN_BLOCK; j++){
+                int32_t estimate = table.bias + std::lround(table.scale*sums[j]);
+                out[j] = std::max(std::min(estimate, (int32_t)INT16_MAX), (int32_t)INT16_MIN);
+            }
+        #endif
+        }
+
 
     #if __AVX2__        
         //Precompute all distance between centroids using AVX2 instructions
         void createDistanceTable(){
+            centroidDistances.clear();
             for(unsigned int m = 0; m < M; m++){
                 std::vector<std::vector<int16_t>> subspaceDists;
                 for(int k1 = 0; k1 < K; k1++){
@@ -102,6 +286,7 @@ namespace puffinn{
     #else        
         //Precompute all distance between centroids 
         void createDistanceTable(){
+            centroidDistances.clear();
             for(unsigned int m = 0; m < M; m++){
                 std::vector<std::vector<int16_t>> subspaceDists;
                 for(int k1 = 0; k1 < K; k1++){
@@ -117,12 +302,11 @@ namespace puffinn{
         }
     #endif
 
-        //builds a dataset where each vector only contains the mth chunk
-        std::vector<std::vector<float>> getSubspace(unsigned int m) {
-            unsigned int N = dataset.get_size();
-            std::vector<std::vector<float>> subspace(N, std::vector<float>(subspaceSizes[m]));
-            for (unsigned int i = 0; i < N; i++) {
-                UnitVectorFormat::Type *start = dataset[i] + offsets[m];
+        //builds a dataset where each vector only contains the mth chunk of the given points
+        std::vector<std::vector<float>> getSubspace(unsigned int m, const std::vector<unsigned int> &indices) {
+            std::vector<std::vector<float>> subspace(indices.size(), std::vector<float>(subspaceSizes[m]));
+            for (size_t i = 0; i < indices.size(); i++) {
+                UnitVectorFormat::Type *start = dataset[indices[i]] + offsets[m];
                 for (unsigned int d = 0; d < subspaceSizes[m]; d++) {
                     subspace[i][d] = UnitVectorFormat::from_16bit_fixed_point(*(start + d));
                     
@@ -131,33 +315,81 @@ namespace puffinn{
             return subspace;
         }
 
+        //Indices of the points used to train the codebook, in increasing order
+        std::vector<unsigned int> getTrainingSample() {
+            unsigned int N = dataset.get_size();
+            std::vector<unsigned int> indices(N);
+            std::iota(indices.begin(), indices.end(), 0u);
+            if (trainingSampleSize == 0 || trainingSampleSize >= N) {
+                return indices;
+            }
+            //Partial Fisher-Yates shuffle
+            auto &rand_gen = get_default_random_generator();
+            for (unsigned int i = 0; i < trainingSampleSize; i++) {
+                std::uniform_int_distribution<unsigned int> random_idx(i, N-1);
+                std::swap(indices[i], indices[random_idx(rand_gen)]);
+            }
+            indices.resize(trainingSampleSize);
+            std::sort(indices.begin(), indices.end());
+            return indices;
+        }
 
-        //Runs kmeans for all m subspaces and stores the centroids in codebooks
+        //Runs kmeans for all m subspaces on a sample of the points and stores the centroids in codebooks
+        //Afterwards every point is encoded using the nearest centroid in each subspace
         void createCodebook(){
-            unsigned int k = std::min(K, dataset.get_size());
-            //used to keep track of where subspace begins
+            std::vector<unsigned int> sample = getTrainingSample();
+            unsigned int k = std::min(K, static_cast<unsigned int>(sample.size()));
+            fittedCentroids = k;
+            codebook.clear();
+            subspaceSizesStored.clear();
+
+            //The instances are created up front, since seeding them uses the shared random generator.
+            //Most points keep their centroid after the first few iterations, which the bounds of hamerly exploit.
+            std::vector<KMeans> clusterers;
+            clusterers.reserve(M);
+            for (unsigned int m = 0; m < M; m++) {
+                clusterers.emplace_back(k, MODE, 3, 100, 0.001f, KMeans::hamerly);
+            }
+            std::vector<std::vector<std::vector<float>>> centroids(M);
+
+            //Subspaces are trained concurrently when there are enough of them to occupy every thread.
+            //Otherwise they are trained one at a time, with each kmeans assignment step running in parallel.
+            bool concurrent = false;
+        #ifdef _OPENMP
+            concurrent = M >= static_cast<unsigned int>(omp_get_max_threads());
+        #endif
+            #pragma omp parallel for schedule(dynamic) if(concurrent)
             for(unsigned int m = 0; m < M ; m++)
             {
-                //RunKmeans for the given subspace
-                //gb_labels for this subspace will be the mth index of the PQcodes
-                
-                KMeans kmeans(k, MODE); 
-                std::vector<std::vector<float>> subspace = getSubspace(m);
-                kmeans.fit(subspace);
-                std::vector<std::vector<float>> centroids  = kmeans.getAllCentroids();
-                
-                //precompute pqCodes for all points in dataset
-                for(unsigned int i = 0; i < k; i++){
-                    for(unsigned int mem: kmeans.getGBMembers(i)){
-                        pqCodes[mem].push_back(i);
+                std::vector<std::vector<float>> subspace = getSubspace(m, sample);
+                clusterers[m].fit(subspace);
+                centroids[m] = clusterers[m].getAllCentroids();
+            }
+
+            //Encode the points in chunks, so that only a bounded number of them is converted to floats at once
+            std::vector<unsigned int> chunk;
+            for (unsigned int first = 0; first < dataset.get_size(); first += PQ_ENCODE_CHUNK) {
+                unsigned int last = std::min(first+PQ_ENCODE_CHUNK, dataset.get_size());
+                chunk.resize(last-first);
+                std::iota(chunk.begin(), chunk.end(), first);
+                #pragma omp parallel for schedule(dynamic) if(concurrent)
+                for (unsigned int m = 0; m < M; m++) {
+                    std::vector<std::vector<float>> subspace = getSubspace(m, chunk);
+                    std::vector<unsigned int> labels = clusterers[m].predict(subspace);
+                    for (size_t i = 0; i < chunk.size(); i++) {
+                        pqCodes[static_cast<size_t>(chunk[i])*M + m] = labels[i];
                     }
                 }
+            }
 
+            for(unsigned int m = 0; m < M ; m++)
+            {
                 // Convert back to UnitVectorFormat and store in codebook
-                codebook.push_back(Dataset<UnitVectorFormat>(subspaceSizes[m], dataset.get_size()));
+                // Room is made for K centroids, since lookups go through all of them even when fewer were fitted
+                codebook.push_back(Dataset<UnitVectorFormat>(subspaceSizes[m], K));
                 for (unsigned int i = 0; i < k; i++) {
                     UnitVectorFormat::Type *c_p = codebook[m][i];
-                    float *vec_p = &centroids[i][0];
+                    float *vec_p = &centroids[m][i][0];
                     for (unsigned int d = 0; d < subspaceSizes[m]; d++) {
                         *c_p++ = UnitVectorFormat::to_16bit_fixed_point(*vec_p++);
                     }
@@ -169,26 +401,46 @@ namespace puffinn{
 
 
 
-        //Naive way of getting PQCode will be usefull if we decide to use samples to construct centroids
-        std::vector<uint8_t> getPQCode(typename UnitVectorFormat::Type* vec) const {
-            std::vector<uint8_t> pqCode;
+        //Writes the M codes of a vector, which are its nearest fitted centroid in each subspace
+        void encode(typename UnitVectorFormat::Type* vec, uint8_t *code) const {
             for(unsigned int m = 0; m < M; m++){
-                float minDistance = FLT_MAX;
+                const int16_t *sub = vec+offsets[m];
+                int64_t minDistance = INT64_MAX;
                 uint8_t quantization = 0;
-                for(int k = 0; k < K; k++){
-                    float d = UnitVectorFormat::distance(vec+offsets[m], codebook[m][k], subspaceSizes[m]);
+                for(unsigned int k = 0; k < fittedCentroids; k++){
+                    const int16_t *centroid = codebook[m][k];
+                    int64_t d = 0;
+                    for(unsigned int i = 0; i < subspaceSizes[m]; i++){
+                        int32_t diff = static_cast<int32_t>(sub[i])-centroid[i];
+                        d += static_cast<int64_t>(diff)*diff;
+                    }
                     if(d < minDistance){
                         minDistance = d;
-                        quantization = k;    
+                        quantization = k;
                     }
                 }
-                pqCode.push_back(quantization);
+                code[m] = quantization;
             }
+        }
+
+        std::vector<uint8_t> getPQCode(typename UnitVectorFormat::Type* vec) const {
+            std::vector<uint8_t> pqCode(M);
+            encode(vec, pqCode.data());
             return pqCode;
         }
 
-        void precomp_query_to_centroids(typename UnitVectorFormat::Type* y) const {
-            if (!is_build) return;
+        //Number of entries in the lookup table filled by precomp_query_to_centroids
+        unsigned int getLookupTableSize() const {
+            return K*M;
+        }
+
+        //Fills the M x K lookup table of inner products between the query and every centroid
+        //The table is owned by the caller, so that queries can be processed concurrently
+        void precomp_query_to_centroids(typename UnitVectorFormat::Type* y, int16_t *queryDistances) const {
+            if (!is_build) {
+                std::fill_n(queryDistances, K*M, 0);
+                return;
+            }
             alignas(32) int16_t paddedY[getPadSize()];
             createPaddedQueryPoint(y, paddedY);
             int16_t *a_p = &paddedY[0];
@@ -202,9 +454,10 @@ namespace puffinn{
             }
         }
 
-        int16_t estimatedInnerProduct(unsigned int xi) const {
+        //Estimates the inner product using a lookup table filled by precomp_query_to_centroids
+        int16_t estimatedInnerProduct(const int16_t *queryDistances, unsigned int xi) const {
             int16_t sum = 0;
-            const uint8_t *p = &pqCodes[xi][0];
+            const uint8_t *p = getCode(xi);
             for(unsigned int var = 0; var < LIM; var += 4*K, p+=4){
                 sum += queryDistances[var + *p];
                 sum += queryDistances[var +   K + *(p+1)];
@@ -235,7 +488,7 @@ namespace puffinn{
         //Distance from PQCode to actual vector using precomputed PQCodes
         float quantizationError(unsigned int vec_i) const {
             float sum = 0;
-            std::vector<uint8_t> pqCode = pqCodes[vec_i];
+            const uint8_t *pqCode = getCode(vec_i);
             int centroidID;
             for(unsigned int m = 0; m < M; m++){
                 centroidID = pqCode[m];
@@ -276,7 +529,8 @@ namespace puffinn{
         int16_t symmetricDistanceComputation(unsigned int xi, typename UnitVectorFormat::Type* y) const {
             int16_t sum = 0;
             //quantize x and y
-            std::vector<uint8_t> px = pqCodes[xi], py = getPQCode(y);
+            const uint8_t *px = getCode(xi);
+            std::vector<uint8_t> py = getPQCode(y);
             //approximate distance by product quantization (precomputed centroid distances required)
             for(unsigned int m = 0; m < M; m++){
                 sum += centroidDistances[m][px[m]][py[m]];
@@ -299,7 +553,7 @@ namespace puffinn{
                 for(unsigned int i = 0; i < subspaceSizes[m]; i++){
                     *a++ = *y++;
                 }
-                unsigned int padd = 16 - (subspaceSizes[m] % 16);
+                unsigned int padd = (16 - (subspaceSizes[m] % 16)) % 16;
                 a = std::fill_n(a, padd, 0);
             }
         }  
@@ -321,7 +575,7 @@ namespace puffinn{
         
         int16_t asymmetricDistanceComputation_avx(unsigned int xi, typename UnitVectorFormat::Type* y) const {
             int16_t sum = 0;
-            const uint8_t *px_p = &pqCodes[xi][0];
+            const uint8_t *px_p = getCode(xi);
             const unsigned int *size_p = &subspaceSizesStored[0];
             const Dataset<UnitVectorFormat> *cb_p = &codebook[0];
             for(unsigned int m = 0; m <M; m++){
@@ -356,7 +610,7 @@ namespace puffinn{
         ///@param y pointer to start of UnitVector (not padded for each subspace)
         int16_t asymmetricDistanceComputation(unsigned int xi, typename UnitVectorFormat::Type* y) const{
             int16_t sum = 0;
-            const uint8_t *px_p = &pqCodes[xi][0];
+            const uint8_t *px_p = getCode(xi);
             const unsigned int *size_p = &subspaceSizes[0];
             const Dataset<UnitVectorFormat> *cb_p = &codebook[0];
             for(unsigned int m = 0; m <M; m++){
@@ -389,6 +643,30 @@ namespace puffinn{
             return sumOfThresholds/nruns;            
         }
 
+        //Estimates how much the inner products estimated from the codes underestimate the actual inner products.
+        //The given quantile of the underestimation of random pairs of points is used.
+        int16_t bootStrapMargin(unsigned int nruns = 50, unsigned int sizeOfRun = 200, float quantile = 0.95f) const {
+            auto &rand_gen = get_default_random_generator();
+            std::uniform_int_distribution<unsigned int> random_idx(0, dataset.get_size()-1);
+            std::vector<int16_t> distances(getLookupTableSize());
+            std::vector<int32_t> errors;
+            for(unsigned int run = 0; run < nruns; run++){
+                unsigned int query = random_idx(rand_gen);
+                precomp_query_to_centroids(dataset[query], distances.data());
+                for(unsigned int i = 0; i < sizeOfRun; i++){
+                    unsigned int idx = random_idx(rand_gen);
+                    //The inner product of a point with itself can overflow
+                    if(idx == query) continue;
+                    int32_t actual = dot_product_i16(dataset[query], dataset[idx], dataset.get_description().storage_len);
+                    errors.push_back(actual-estimatedInnerProduct(distances.data(), idx));
+                }
+            }
+            if(errors.empty()) return 0;
+            auto pos = errors.begin()+std::min<size_t>(errors.size()-1, quantile*errors.size());
+            std::nth_element(errors.begin(), pos, errors.end());
+            return std::max(0, std::min(*pos, (int32_t)INT16_MAX));
+        }
+
         //Functions below are just debugging tools and old code that might be useful down the road
         /*
         std::vector<float> getCentroid(unsigned int mID, unsigned int kID){
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "puffinn/bitpacking.hpp"
 #include "puffinn/dataset.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/mmap.hpp"
 #include "puffinn/typedefs.hpp"
 #include "puffinn/performance.hpp"
 
@@ -13,6 +15,12 @@
 #include <utility>
 #include <vector>
 
+// Number of bits of the hashes that the prefix index of each PrefixMap is built over.
+// The default of 0 chooses it depending on the number of stored values.
+#ifndef PUFFINN_PREFIX_INDEX_BITS
+    #define PUFFINN_PREFIX_INDEX_BITS 0
+#endif
+
 namespace puffinn {
     // A query stores the hash, the current prefix as well as which segment in the map that has
     // already been searched.
@@ -33,7 +41,7 @@ namespace puffinn {
         // in the map to process.
         PrefixMapQuery(
             LshDatatype hash,
-            const std::vector<LshDatatype>& hashes,
+            const LshDatatype* hashes,
             uint32_t prefix_index_start,
             uint32_t prefix_index_end
         )
@@ -61,16 +69,26 @@ namespace puffinn {
     // This allows querying all values that share a common prefix. The length of the prefix
     // can be decreased to look at a larger set of values. When the prefix is decreased,
     // previously queried values are not queried again.
-    template <typename T>
+    //
+    // The map can optionally be stored compressed. In that case, only the bits of each hash
+    // below the indexed prefix are stored, and indices are bit-packed. Ranges are then decoded
+    // into a buffer supplied by the caller when searching.
+    //
+    // TSketch is the type of the filter sketches that can optionally be stored with the values.
+    template <typename T, typename TSketch = FilterLshDatatype>
     class PrefixMap {
         using HashedVecIdx = std::pair<uint32_t, LshDatatype>;
 
-        // Number of bits to precompute locations in the stored vector for.
-        const static int PREFIX_INDEX_BITS = 13;
+        // Bounds on the number of bits to precompute locations in the stored vector for.
+        const static unsigned int MIN_PREFIX_INDEX_BITS = 1;
+        const static unsigned int MAX_PREFIX_INDEX_BITS = 20;
+        // Targeted average number of values sharing each indexed prefix.
+        // Smaller values make the binary search shorter at the cost of a larger index.
+        const static size_t PREFIX_INDEX_BUCKET_SIZE = 8;
 
         // contents
-        std::vector<uint32_t> indices;
-        std::vector<LshDatatype> hashes;
+        MappableArray<uint32_t> indices;
+        MappableArray<LshDatatype> hashes;
         // Scratch space for use when rebuilding. The length and capacity is set to 0 otherwise.
         std::vector<HashedVecIdx> rebuilding_data;
 
@@ -78,10 +96,31 @@ namespace puffinn {
         unsigned int hash_length;
         std::unique_ptr<Hash> hash_function;
 
+        // Number of bits to precompute locations in the stored vector for.
+        // Chosen depending on the number of stored values.
+        unsigned int prefix_index_bits;
         // index of the first value with each prefix.
         // If there is no such value, it is the first higher prefix instead.
         // Used as a hint for the binary search.
-        uint32_t prefix_index[(1 << PREFIX_INDEX_BITS)+1] = {0};
+        MappableArray<uint32_t> prefix_index;
+
+        // Whether the contents are stored compressed after the next rebuild.
+        bool compressed = false;
+        // Compressed contents, which are used instead of indices and hashes.
+        // The prefix of each hash is given by the prefix index, so only the remaining bits are stored.
+        // Values are not padded, and the prefix index refers directly to positions in these arrays.
+        MappableArray<uint16_t> hash_suffixes;
+        BitPackedArray packed_indices;
+        // Optional filter sketches of the stored values in the same order as indices,
+        // so that a range of candidates can be filtered by a linear scan.
+        // The padding has sketches of zero. Discarded whenever the contents change.
+        MappableArray<TSketch> sketches;
+        // Optional codes of the stored values in the same order as indices, grouped into blocks of
+        // code_block_len values that take code_block_bytes each, such as the fast-scan codes of PQFilter.
+        // Discarded whenever the contents change. They are not serialized.
+        MappableArray<uint8_t> code_blocks;
+        unsigned int code_block_len = 0;
+        unsigned int code_block_bytes = 0;
 
     public:
         // Construct a new prefix map over the specified dataset using the given hash functions.
@@ -94,14 +133,8 @@ namespace puffinn {
         }
 
         PrefixMap(std::istream& in, HashSource<T>& source) {
-            size_t len;
-            in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
-            indices.resize(len);
-            hashes.resize(len);
-            if (len != 0) {
-                in.read(reinterpret_cast<char*>(&indices[0]), len*sizeof(uint32_t));
-                in.read(reinterpret_cast<char*>(&hashes[0]), len*sizeof(LshDatatype));
-            }
+            read_section(in, indices);
+            read_section(in, hashes);
 
             size_t rebuilding_len;
             in.read(reinterpret_cast<char*>(&rebuilding_len), sizeof(size_t));
@@ -115,18 +148,18 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(&hash_length), sizeof(unsigned int));
             hash_function = source.deserialize_hash(in);
 
-            in.read(
-                reinterpret_cast<char*>(&prefix_index[0]),
-                ((1 << PREFIX_INDEX_BITS)+1)*sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(&prefix_index_bits), sizeof(unsigned int));
+            read_section(in, prefix_index);
+
+            in.read(reinterpret_cast<char*>(&compressed), sizeof(bool));
+            read_section(in, hash_suffixes);
+            packed_indices = BitPackedArray(in);
+            read_section(in, sketches);
         }
 
         void serialize(std::ostream& out) const {
-            size_t len = indices.size();
-            out.write(reinterpret_cast<const char*>(&len), sizeof(size_t));
-            if (len != 0) {
-                out.write(reinterpret_cast<const char*>(&indices[0]), len*sizeof(uint32_t));
-                out.write(reinterpret_cast<const char*>(&hashes[0]), len*sizeof(LshDatatype));
-            }
+            write_section(out, indices.data(), indices.size());
+            write_section(out, hashes.data(), hashes.size());
 
             size_t rebuilding_len = rebuilding_data.size();
             out.write(reinterpret_cast<const char*>(&rebuilding_len), sizeof(size_t));
@@ -139,9 +172,88 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&hash_length), sizeof(unsigned int));
             hash_function->serialize(out);
 
-            out.write(reinterpret_cast<const char*>(
-                &prefix_index),
-                ((1 << PREFIX_INDEX_BITS)+1)*sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&prefix_index_bits), sizeof(unsigned int));
+            write_section(out, prefix_index.data(), prefix_index.size());
+
+            out.write(reinterpret_cast<const char*>(&compressed), sizeof(bool));
+            write_section(out, hash_suffixes.data(), hash_suffixes.size());
+            packed_indices.serialize(out);
+            write_section(out, sketches.data(), sketches.size());
+        }
+
+        // Set whether the contents should be stored compressed.
+        // This takes effect the next time rebuild is called.
+        void set_compressed(bool compress) {
+            compressed = compress;
+        }
+
+        // Store a sketch of every value next to its index, where sketch_of(idx) is
+        // the sketch of the value with index idx.
+        // Compressed maps do not support sketches, so nothing is stored for them.
+        // The sketches are discarded by the next rebuild or compaction that changes the contents.
+        template <typename F>
+        void set_sketches(F sketch_of) {
+            if (hashes.empty()) {
+                sketches = MappableArray<TSketch>();
+                return;
+            }
+            sketches.assign(indices.size(), 0);
+            for (size_t pos=SEGMENT_SIZE; pos+SEGMENT_SIZE < indices.size(); pos++) {
+                sketches[pos] = sketch_of(indices[pos]);
+            }
+        }
+
+        void clear_sketches() {
+            sketches = MappableArray<TSketch>();
+        }
+
+        bool has_sketches() const {
+            return !sketches.empty();
+        }
+
+        // Retrieve the sketches of a range returned by get_next_range, starting with the
+        // sketch of the value at range_start. Requires that sketches are stored.
+        const TSketch* get_sketches(const uint32_t* range_start) const {
+            return sketches.data()+(range_start-indices.data());
+        }
+
+        // Store the codes of every value in blocks of block_len values taking block_bytes each,
+        // where pack(block, j, idx) writes the code of the value with index idx
+        // to position j of a zeroed block.
+        // Compressed maps do not support codes, so nothing is stored for them.
+        // The codes are discarded by the next rebuild or compaction that changes the contents.
+        template <typename F>
+        void set_code_blocks(unsigned int block_len, unsigned int block_bytes, F pack) {
+            if (hashes.empty()) {
+                clear_code_blocks();
+                return;
+            }
+            code_block_len = block_len;
+            code_block_bytes = block_bytes;
+            size_t num_blocks = (indices.size()+block_len-1)/block_len;
+            code_blocks.assign(num_blocks*block_bytes, 0);
+            for (size_t pos=SEGMENT_SIZE; pos+SEGMENT_SIZE < indices.size(); pos++) {
+                pack(&code_blocks[(pos/block_len)*block_bytes], pos%block_len, indices[pos]);
+            }
+        }
+
+        void clear_code_blocks() {
+            code_blocks = MappableArray<uint8_t>();
+        }
+
+        bool has_code_blocks() const {
+            return !code_blocks.empty();
+        }
+
+        // Position in the stored values of a value in a range returned by get_next_range.
+        size_t get_position(const uint32_t* value) const {
+            return value-indices.data();
+        }
+
+        // Retrieve the block of codes containing the value at the given position,
+        // which is at position pos%block_len within the block. Requires that codes are stored.
+        const uint8_t* get_code_block(size_t pos) const {
+            return code_blocks.data()+(pos/code_block_len)*code_block_bytes;
         }
 
         // Add a vector to be included next time rebuild is called. 
@@ -150,35 +262,130 @@ namespace puffinn {
             rebuilding_data.push_back({ idx, (*hash_function)(hash_state) });
         }
 
+        // Reserve slots for `count` values that are inserted using insert_at
+        // and are included next time rebuild is called.
+        // Returns the first reserved slot.
+        size_t prepare_insert(size_t count) {
+            size_t first_slot = rebuilding_data.size();
+            rebuilding_data.resize(first_slot+count);
+            return first_slot;
+        }
+
+        // Insert a vector into a slot reserved using prepare_insert.
+        // Different slots can be written to concurrently.
+        void insert_at(size_t slot, uint32_t idx, HashSourceState* hash_state) {
+            rebuilding_data[slot] = { idx, (*hash_function)(hash_state) };
+        }
+
         // Reserve the correct amount of memory before inserting.
         void reserve(size_t size) {
-            if (hashes.size() == 0) {
-                rebuilding_data.reserve(size);
-            } else {
-                rebuilding_data.reserve(size-(hashes.size()-2*SEGMENT_SIZE));
+            rebuilding_data.reserve(size-stored_size());
+        }
+
+        // Number of bits of the hashes that the prefix index is built over as of the last rebuild.
+        unsigned int get_prefix_index_bits() const {
+            return prefix_index_bits;
+        }
+
+        // Number of values stored as of the last rebuild.
+        size_t stored_size() const {
+            if (hashes.size() != 0) {
+                return hashes.size()-2*SEGMENT_SIZE;
             }
+            return packed_indices.size();
         }
 
         void rebuild() {
-            // A value whose prefix will never match that of a query vector, as long as less than 32
-            // hash bits are used.
-            static const LshDatatype IMPOSSIBLE_PREFIX = 0xffffffff;
+            bool stored_compressed = hashes.empty();
+            if (rebuilding_data.empty() && stored_compressed == compressed) {
+                return;
+            }
+            // Only the new values are sorted, after which they are merged with the
+            // already sorted stored values in linear time.
+            radix_sort(rebuilding_data, hash_length);
+            std::vector<HashedVecIdx> stored;
+            stored.reserve(stored_size());
+            append_stored(stored);
+            if (!stored.empty()) {
+                std::vector<HashedVecIdx> merged(stored.size()+rebuilding_data.size());
+                std::merge(
+                    stored.begin(), stored.end(),
+                    rebuilding_data.begin(), rebuilding_data.end(),
+                    merged.begin(),
+                    [](const HashedVecIdx& a, const HashedVecIdx& b) { return a.second < b.second; });
+                stored = std::vector<HashedVecIdx>();
+                rebuilding_data.swap(merged);
+            }
+            build_sorted();
+        }
+
+        // Remove values and give the remaining values new indices without rehashing them.
+        // new_indices[idx] is the new index of the value with index idx,
+        // or REMOVED_INDEX if the value is removed.
+        void compact(const std::vector<uint32_t>& new_indices) {
+            // Values inserted since the last rebuild stay pending.
+            std::vector<HashedVecIdx> pending;
+            pending.swap(rebuilding_data);
+            remap_indices(pending, new_indices);
+
+            rebuilding_data.reserve(stored_size());
+            append_stored(rebuilding_data);
+            // Removing values does not change the order of the remaining values.
+            remap_indices(rebuilding_data, new_indices);
+            build_sorted();
+            rebuilding_data.swap(pending);
+        }
 
-            rebuilding_data.reserve(hashes.size()+rebuilding_data.size());
+    private:
+        // Append the stored values in sorted order.
+        void append_stored(std::vector<HashedVecIdx>& out) const {
             if (hashes.size() != 0) {
-                // Move data to temporary vector for sorting.
                 for (size_t i=SEGMENT_SIZE; i < hashes.size()-SEGMENT_SIZE; i++) {
-                    rebuilding_data.push_back({ indices[i], hashes[i] });
+                    out.push_back({ indices[i], hashes[i] });
                 }
             }
-            
-            std::sort(
-                rebuilding_data.begin(),
-                rebuilding_data.end(),
-                [](HashedVecIdx& a, HashedVecIdx& b) {
-                    return a.second < b.second;
+            if (packed_indices.size() != 0) {
+                auto suffix_bits = hash_length-prefix_index_bits;
+                for (LshDatatype prefix=0; prefix < (1u << prefix_index_bits); prefix++) {
+                    for (size_t i=prefix_index[prefix]; i < prefix_index[prefix+1]; i++) {
+                        out.push_back({
+                            packed_indices.get(i),
+                            (prefix << suffix_bits) | hash_suffixes[i]
+                        });
+                    }
                 }
-            );
+            }
+        }
+
+        static void remap_indices(
+            std::vector<HashedVecIdx>& values,
+            const std::vector<uint32_t>& new_indices
+        ) {
+            size_t len = 0;
+            for (auto& v : values) {
+                auto idx = new_indices[v.first];
+                if (idx != REMOVED_INDEX) {
+                    values[len] = { idx, v.second };
+                    len++;
+                }
+            }
+            values.resize(len);
+        }
+
+        // Store the contents of rebuilding_data, which must be sorted by hash.
+        void build_sorted() {
+            // A value whose prefix will never match that of a query vector, as long as less than 32
+            // hash bits are used.
+            static const LshDatatype IMPOSSIBLE_PREFIX = 0xffffffff;
+
+            if (compressed) {
+                build_compressed();
+                return;
+            }
+            hash_suffixes = MappableArray<uint16_t>();
+            packed_indices = BitPackedArray();
+            sketches = MappableArray<TSketch>();
+            code_blocks = MappableArray<uint8_t>();
             std::vector<LshDatatype> new_hashes;
             new_hashes.reserve(rebuilding_data.size()+2*SEGMENT_SIZE);
             std::vector<uint32_t> new_indices;
@@ -201,39 +408,199 @@ namespace puffinn {
             indices = std::move(new_indices);
 
             // Build prefix_index data structure.
+            prefix_index_bits = choose_prefix_index_bits(rebuilding_data.size(), hash_length);
+            prefix_index.assign((1 << prefix_index_bits)+1, 0);
             // Index of the first occurence of the prefix
             uint32_t idx = 0;
-            for (unsigned int prefix=0; prefix < (1u << PREFIX_INDEX_BITS); prefix++) {
+            for (unsigned int prefix=0; prefix < (1u << prefix_index_bits); prefix++) {
                 while (
                     idx < rebuilding_data.size() &&
-                    (hashes[SEGMENT_SIZE+idx] >> (hash_length-PREFIX_INDEX_BITS)) < prefix
+                    (hashes[SEGMENT_SIZE+idx] >> (hash_length-prefix_index_bits)) < prefix
                 ) {
                     idx++;
                 }
                 prefix_index[prefix] = SEGMENT_SIZE+idx;
             }
-            prefix_index[1 << PREFIX_INDEX_BITS] = SEGMENT_SIZE+rebuilding_data.size();
+            prefix_index[1 << prefix_index_bits] = SEGMENT_SIZE+rebuilding_data.size();
+
+            rebuilding_data.clear();
+            rebuilding_data.shrink_to_fit();
+        }
+
+        // Number of bits of the hashes that the prefix index is built over when compressed.
+        // The remaining bits need to fit in the stored suffixes.
+        static unsigned int compressed_prefix_index_bits(size_t size, unsigned int hash_length) {
+            const unsigned int SUFFIX_BITS = 8*sizeof(uint16_t);
+            auto bits = choose_prefix_index_bits(size, hash_length);
+            if (hash_length > SUFFIX_BITS) {
+                bits = std::max(bits, hash_length-SUFFIX_BITS);
+            }
+            return bits;
+        }
+
+        // Store the sorted rebuilding data compressed.
+        void build_compressed() {
+            size_t len = rebuilding_data.size();
+            prefix_index_bits = compressed_prefix_index_bits(len, hash_length);
+            auto suffix_bits = hash_length-prefix_index_bits;
+
+            uint32_t max_idx = 0;
+            for (auto& v : rebuilding_data) {
+                max_idx = std::max(max_idx, v.first);
+            }
+            hash_suffixes.resize(len);
+            packed_indices = BitPackedArray(len, BitPackedArray::bits_needed(max_idx));
+            prefix_index.assign((1 << prefix_index_bits)+1, 0);
+            for (size_t i=0; i < len; i++) {
+                auto hash = rebuilding_data[i].second;
+                hash_suffixes[i] = hash & ((1u << suffix_bits)-1);
+                packed_indices.set(i, rebuilding_data[i].first);
+                // Count the values with each prefix.
+                prefix_index[(hash >> suffix_bits)+1]++;
+            }
+            for (size_t prefix=0; prefix < (1u << prefix_index_bits); prefix++) {
+                prefix_index[prefix+1] += prefix_index[prefix];
+            }
 
+            hashes = MappableArray<LshDatatype>();
+            indices = MappableArray<uint32_t>();
+            sketches = MappableArray<TSketch>();
+            code_blocks = MappableArray<uint8_t>();
             rebuilding_data.clear();
             rebuilding_data.shrink_to_fit();
         }
 
+        // Reconstruct the hash stored at the given position when compressed.
+        LshDatatype compressed_hash(uint32_t position) const {
+            // The prefix is the last one starting at or before the position.
+            LshDatatype prefix = std::upper_bound(
+                prefix_index.begin(),
+                prefix_index.end(),
+                position) - prefix_index.begin() - 1;
+            return (prefix << (hash_length-prefix_index_bits)) | hash_suffixes[position];
+        }
+
+        // Position of the first value with a hash that is at least the given hash when compressed.
+        uint32_t compressed_lower_bound(uint64_t hash) const {
+            if (hash >= (1ull << hash_length)) {
+                return hash_suffixes.size();
+            }
+            auto suffix_bits = hash_length-prefix_index_bits;
+            auto prefix = hash >> suffix_bits;
+            uint16_t suffix = hash & ((1u << suffix_bits)-1);
+            return std::lower_bound(
+                hash_suffixes.begin()+prefix_index[prefix],
+                hash_suffixes.begin()+prefix_index[prefix+1],
+                suffix) - hash_suffixes.begin();
+        }
+
+    public:
+
+        // Sort values by their hash using a least significant digit radix sort.
+        // Only the lowest key_bits bits of the hashes are considered.
+        static void radix_sort(std::vector<HashedVecIdx>& data, unsigned int key_bits) {
+            const unsigned int DIGIT_BITS = 8;
+            const unsigned int NUM_BUCKETS = 1 << DIGIT_BITS;
+
+            std::vector<HashedVecIdx> scratch(data.size());
+            for (unsigned int shift=0; shift < key_bits; shift += DIGIT_BITS) {
+                size_t bucket_starts[NUM_BUCKETS] = {0};
+                for (auto& v : data) {
+                    bucket_starts[(v.second >> shift) & (NUM_BUCKETS-1)]++;
+                }
+                // Every value has the same digit, so the order is unchanged.
+                if (data.empty() || bucket_starts[(data[0].second >> shift) & (NUM_BUCKETS-1)] == data.size()) {
+                    continue;
+                }
+                size_t total = 0;
+                for (unsigned int bucket=0; bucket < NUM_BUCKETS; bucket++) {
+                    auto count = bucket_starts[bucket];
+                    bucket_starts[bucket] = total;
+                    total += count;
+                }
+                for (auto& v : data) {
+                    scratch[bucket_starts[(v.second >> shift) & (NUM_BUCKETS-1)]++] = v;
+                }
+                data.swap(scratch);
+            }
+        }
+
         // Construct a query object to search for the nearest neighbors of the given vector.
         PrefixMapQuery create_query(HashSourceState* hash_state) const {
             g_performance_metrics.start_timer(Computation::Hashing);
             auto hash = (*hash_function)(hash_state);
             g_performance_metrics.store_time(Computation::Hashing);
             g_performance_metrics.start_timer(Computation::CreateQuery);
-            auto prefix = hash >> (hash_length-PREFIX_INDEX_BITS);
+            if (compressed) {
+                auto start = compressed_lower_bound(hash);
+                PrefixMapQuery res(hash, hashes.data(), start, start);
+                g_performance_metrics.store_time(Computation::CreateQuery);
+                return res;
+            }
+            auto prefix = hash >> (hash_length-prefix_index_bits);
             PrefixMapQuery res(
                 hash,
-                hashes,
+                hashes.data(),
                 prefix_index[prefix],
                 prefix_index[prefix+1]);
             g_performance_metrics.store_time(Computation::CreateQuery);
             return res;
         }
 
+        // Construct a query object for the value stored at the given position,
+        // reusing the hash computed when it was inserted.
+        PrefixMapQuery create_query_at(uint32_t position) const {
+            g_performance_metrics.start_timer(Computation::CreateQuery);
+            if (compressed) {
+                auto hash = compressed_hash(position);
+                auto start = compressed_lower_bound(hash);
+                PrefixMapQuery res(hash, hashes.data(), start, start);
+                g_performance_metrics.store_time(Computation::CreateQuery);
+                return res;
+            }
+            auto hash = hashes[position];
+            auto prefix = hash >> (hash_length-prefix_index_bits);
+            // Start at the first value with the same hash.
+            uint32_t start = std::lower_bound(
+                hashes.begin()+prefix_index[prefix],
+                hashes.begin()+position,
+                hash) - hashes.begin();
+            PrefixMapQuery res(hash, hashes.data(), start, start);
+            g_performance_metrics.store_time(Computation::CreateQuery);
+            return res;
+        }
+
+        // Find the positions of the values with indices in [first, last).
+        // The position of index idx is written to positions[(idx-first)*stride].
+        void find_positions(
+            uint32_t first,
+            uint32_t last,
+            uint32_t* positions,
+            size_t stride
+        ) const {
+            if (compressed) {
+                const size_t BLOCK_SIZE = 1024;
+                uint32_t decoded[BLOCK_SIZE];
+                for (size_t block=0; block < packed_indices.size(); block += BLOCK_SIZE) {
+                    size_t block_end = std::min(packed_indices.size(), block+BLOCK_SIZE);
+                    packed_indices.decode(block, block_end, decoded);
+                    for (size_t pos=block; pos < block_end; pos++) {
+                        auto idx = decoded[pos-block];
+                        if (idx >= first && idx < last) {
+                            positions[(idx-first)*stride] = pos;
+                        }
+                    }
+                }
+                return;
+            }
+            for (size_t pos=SEGMENT_SIZE; pos+SEGMENT_SIZE < indices.size(); pos++) {
+                auto idx = indices[pos];
+                if (idx >= first && idx < last) {
+                    positions[(idx-first)*stride] = pos;
+                }
+            }
+        }
+
         // Reduce the length of the prefix by one and retrieve the range of indices that should
         // be considered next.
         // Assumes that everything in the current prefix is already searched. This is not true
@@ -278,11 +645,87 @@ namespace puffinn {
             }
         }
 
-        static uint64_t memory_usage(size_t size, uint64_t function_size) {
+        // Reduce the length of the prefix by one and retrieve the range of indices that should
+        // be considered next.
+        // When the map is compressed, the indices are decoded into the scratch buffer,
+        // which must stay valid for as long as the range is used.
+        // The length of the range is padded to a multiple of 4 by repeating the last index.
+        std::pair<const uint32_t*, const uint32_t*> get_next_range(
+            PrefixMapQuery& query,
+            std::vector<uint32_t>& scratch
+        ) const {
+            if (!compressed) {
+                return get_next_range(query);
+            }
+            // Values sharing the current prefix are exactly those in [prefix_start, prefix_end).
+            // Since the prefix is shortened by a single bit, the new values are all on one side.
+            unsigned int removed_bits = popcountll(static_cast<LshDatatype>(~query.prefix_mask));
+            uint64_t prefix_first = (static_cast<uint64_t>(query.hash) >> removed_bits) << removed_bits;
+            uint32_t start = compressed_lower_bound(prefix_first);
+            uint32_t end = compressed_lower_bound(prefix_first+(1ull << removed_bits));
+            uint32_t range_start = start;
+            uint32_t range_end = query.prefix_start;
+            if (start == query.prefix_start) {
+                range_start = query.prefix_end;
+                range_end = end;
+            }
+            query.prefix_start = start;
+            query.prefix_end = end;
+            query.prefix_mask <<= 1;
+
+            size_t len = range_end-range_start;
+            size_t padded_len = (len+3)/4*4;
+            scratch.resize(std::max(padded_len, static_cast<size_t>(1)));
+            packed_indices.decode(range_start, range_end, &scratch[0]);
+            for (size_t i=len; i < padded_len; i++) {
+                scratch[i] = scratch[len-1];
+            }
+            return std::make_pair(&scratch[0], &scratch[0]+padded_len);
+        }
+
+        // Number of bits of the hashes that the prefix index is built over when storing
+        // `size` values, so that each prefix contains roughly PREFIX_INDEX_BUCKET_SIZE values.
+        // A non-zero PUFFINN_PREFIX_INDEX_BITS is used instead, as long as it fits in the hashes.
+        static unsigned int choose_prefix_index_bits(size_t size, unsigned int hash_length) {
+            if (PUFFINN_PREFIX_INDEX_BITS != 0) {
+                return std::max(1u, std::min<unsigned int>(PUFFINN_PREFIX_INDEX_BITS, hash_length));
+            }
+            unsigned int bits = MIN_PREFIX_INDEX_BITS;
+            while (
+                bits < MAX_PREFIX_INDEX_BITS
+                && bits < hash_length
+                && (size >> bits) > PREFIX_INDEX_BUCKET_SIZE
+            ) {
+                bits++;
+            }
+            return bits;
+        }
+
+        // Memory used to store `size` values, with code_bytes bytes of codes per value.
+        // Sketches and codes are only stored when the map is not compressed.
+        static uint64_t memory_usage(
+            size_t size,
+            uint64_t function_size,
+            bool compressed = false,
+            bool with_sketches = false,
+            uint64_t code_bytes = 0
+        ) {
+            if (compressed) {
+                auto prefix_index_len = (1 << compressed_prefix_index_bits(size, MAX_HASHBITS))+1;
+                return sizeof(PrefixMap)
+                    + size*sizeof(uint16_t)
+                    + BitPackedArray::memory_usage(size, BitPackedArray::bits_needed(size))
+                    + prefix_index_len*sizeof(uint32_t)
+                    + function_size;
+            }
+            auto prefix_index_len = (1 << choose_prefix_index_bits(size, MAX_HASHBITS))+1;
             size = size+2*SEGMENT_SIZE;
             return sizeof(PrefixMap)
                 + size*sizeof(uint32_t)
                 + size*sizeof(LshDatatype)
+                + (with_sketches ? size*sizeof(TSketch) : 0)
+                + size*code_bytes
+                + prefix_index_len*sizeof(uint32_t)
                 + function_size; 
         }
     };
@@ -10,7 +10,7 @@ namespace puffinn {
     /// Measures the cosine of the angle between two unit vectors.
     /// 
     /// This is also known as the angular distance.
-    /// The supported LSH families are ``CrossPolytopeHash``, ``FHTCrossPolytopeHash`` and ``SimHash``.
+    /// The supported LSH families are ``CrossPolytopeHash``, ``FHTCrossPolytopeHash``, ``SimHash`` and ``FHTSimHash``.
     struct CosineSimilarity {
         using Format = UnitVectorFormat;
         using DefaultHash = FHTCrossPolytopeHash;
@@ -26,3 +26,4 @@ namespace puffinn {
 
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
+#include "puffinn/hash/fht_simhash.hpp"
@@ -32,6 +32,9 @@ struct PySerializeIter {
 
 struct AbstractIndex {
     virtual void rebuild() = 0;
+    virtual void remove(uint32_t idx) = 0;
+    virtual void compact() = 0;
+    virtual void set_rebuild_threshold(uint32_t threshold) = 0;
     virtual std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -57,6 +60,12 @@ public:
         float recall,
         FilterType filter_type
     ) = 0;
+    virtual std::vector<std::vector<uint32_t>> search_batch(
+        const std::vector<std::vector<float>>& vecs,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) = 0;
 };
 
 template <typename T, typename U = SimHash>
@@ -85,6 +94,18 @@ public:
         table.rebuild();
     }
 
+    void remove(uint32_t idx) {
+        table.remove(idx);
+    }
+
+    void compact() {
+        table.compact();
+    }
+
+    void set_rebuild_threshold(uint32_t threshold) {
+        table.set_rebuild_threshold(threshold);
+    }
+
     std::vector<uint32_t> search(
         const std::vector<float>& vec,
         unsigned int k,
@@ -94,6 +115,15 @@ public:
         return table.search(vec, k, recall, filter_type);
     }
 
+    std::vector<std::vector<uint32_t>> search_batch(
+        const std::vector<std::vector<float>>& vecs,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search_batch(vecs, k, recall, filter_type);
+    }
+
     std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -142,6 +172,12 @@ public:
         float recall,
         FilterType filter_type
     ) = 0;
+    virtual std::vector<std::vector<uint32_t>> search_batch(
+        const std::vector<std::vector<uint32_t>>& vecs,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) = 0;
 };
 
 template <typename T, typename U = MinHash1Bit>
@@ -174,6 +210,18 @@ public:
         table.rebuild();
     }
 
+    void remove(uint32_t idx) {
+        table.remove(idx);
+    }
+
+    void compact() {
+        table.compact();
+    }
+
+    void set_rebuild_threshold(uint32_t threshold) {
+        table.set_rebuild_threshold(threshold);
+    }
+
     std::vector<uint32_t> search(
         const std::vector<uint32_t>& vec,
         unsigned int k,
@@ -183,6 +231,15 @@ public:
         return table.search(vec, k, recall, filter_type);
     }
 
+    std::vector<std::vector<uint32_t>> search_batch(
+        const std::vector<std::vector<uint32_t>>& vecs,
+        unsigned int k,
+        float recall,
+        FilterType filter_type
+    ) {
+        return table.search_batch(vecs, k, recall, filter_type);
+    }
+
     std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -293,6 +350,30 @@ public:
         }
     }
 
+    void remove(uint32_t idx) {
+        if (real_table) {
+            real_table->remove(idx);
+        } else {
+            set_table->remove(idx);
+        }
+    }
+
+    void compact() {
+        if (real_table) {
+            real_table->compact();
+        } else {
+            set_table->compact();
+        }
+    }
+
+    void set_rebuild_threshold(uint32_t threshold) {
+        if (real_table) {
+            real_table->set_rebuild_threshold(threshold);
+        } else {
+            set_table->set_rebuild_threshold(threshold);
+        }
+    }
+
     FilterType get_filter_type(const std::string& name) {
         FilterType filter_type;
         if (name == "default") {
@@ -301,6 +382,8 @@ public:
             filter_type = FilterType::None;
         } else if (name == "simple") {
             filter_type = FilterType::Simple;
+        } else if (name == "pq") {
+            filter_type = FilterType::PQ;
         } else {
             throw std::invalid_argument("filter_type");
         }
@@ -323,6 +406,25 @@ public:
         }
     }
 
+    std::vector<std::vector<uint32_t>> search_batch(
+        py::object queries,
+        unsigned int k,
+        float recall,
+        std::string filter_name
+    ) {
+        auto filter_type = get_filter_type(filter_name);
+        if (real_table) {
+            auto vecs = to_real_vectors(queries);
+            // The index is not accessed from python during the search.
+            py::gil_scoped_release release;
+            return real_table->search_batch(vecs, k, recall, filter_type);
+        } else {
+            auto vecs = queries.cast<std::vector<std::vector<uint32_t>>>();
+            py::gil_scoped_release release;
+            return set_table->search_batch(vecs, k, recall, filter_type);
+        }
+    }
+
     std::vector<uint32_t> search_from_index(
         uint32_t idx,
         unsigned int k,
@@ -393,6 +495,24 @@ public:
     }
 
 private:
+    // Convert either a two-dimensional numpy array or a list of lists to vectors.
+    static std::vector<std::vector<float>> to_real_vectors(py::object queries) {
+        if (py::isinstance<py::array>(queries)) {
+            auto arr = py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(queries);
+            if (!arr || arr.ndim() != 2) {
+                throw std::invalid_argument("queries");
+            }
+            auto rows = arr.unchecked<2>();
+            std::vector<std::vector<float>> res;
+            res.reserve(rows.shape(0));
+            for (py::ssize_t i=0; i < rows.shape(0); i++) {
+                res.emplace_back(rows.data(i, 0), rows.data(i, 0)+rows.shape(1));
+            }
+            return res;
+        }
+        return queries.cast<std::vector<std::vector<float>>>();
+    }
+
     template <typename T>
     void set(T& field, const py::dict& params, const char* name) {
         if (params.contains(name)) {
@@ -528,10 +648,17 @@ PYBIND11_MODULE(puffinn, m) {
         .def(py::init<const std::string&, const unsigned int&, const uint64_t&, const py::kwargs&>())
         .def("insert", &Index::insert)
         .def("rebuild", &Index::rebuild)
+        .def("remove", &Index::remove)
+        .def("compact", &Index::compact)
+        .def("set_rebuild_threshold", &Index::set_rebuild_threshold)
         .def("search", &Index::search,
              py::arg("vec"), py::arg("k"), py::arg("recall"),
              py::arg("filter_type") = "default"
          )
+        .def("search_batch", &Index::search_batch,
+             py::arg("queries"), py::arg("k"), py::arg("recall"),
+             py::arg("filter_type") = "default"
+         )
         .def("search_from_index", &Index::search_from_index,
             py::arg("index"), py::arg("k"), py::arg("recall"),
             py::arg("filter_type") = "default"
@@ -4,6 +4,8 @@
 #include "similarity_measure_test.hpp"
 #include "format_test.hpp"
 #include "prefixmap_test.hpp"
+#include "bitpacking_test.hpp"
+#include "mmap_test.hpp"
 #include "hash_test.hpp"
 #include "hash_source_test.hpp"
 #include "filterer_test.hpp"
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "catch.hpp"
+#include "puffinn/bitpacking.hpp"
+
+#include <sstream>
+
+namespace bitpacking {
+    using namespace puffinn;
+
+    TEST_CASE("BitPackedArray::bits_needed") {
+        REQUIRE(BitPackedArray::bits_needed(0) == 1);
+        REQUIRE(BitPackedArray::bits_needed(1) == 1);
+        REQUIRE(BitPackedArray::bits_needed(2) == 2);
+        REQUIRE(BitPackedArray::bits_needed(255) == 8);
+        REQUIRE(BitPackedArray::bits_needed(256) == 9);
+        REQUIRE(BitPackedArray::bits_needed(0xffffffff) == 32);
+    }
+
+    TEST_CASE("BitPackedArray get and decode") {
+        for (unsigned int bits : {1, 7, 13, 25, 26, 32}) {
+            size_t len = 1000;
+            uint32_t mask = (bits == 32 ? 0xffffffff : (1u << bits)-1);
+            std::vector<uint32_t> values;
+            BitPackedArray arr(len, bits);
+            for (size_t i=0; i < len; i++) {
+                values.push_back((i*2654435761u) & mask);
+                arr.set(i, values.back());
+            }
+            for (size_t i=0; i < len; i++) {
+                REQUIRE(arr.get(i) == values[i]);
+            }
+            // Ranges that are not aligned to the vector width.
+            std::vector<uint32_t> decoded(len);
+            arr.decode(3, 990, &decoded[0]);
+            for (size_t i=3; i < 990; i++) {
+                REQUIRE(decoded[i-3] == values[i]);
+            }
+
+            std::stringstream s;
+            arr.serialize(s);
+            BitPackedArray deserialized(s);
+            REQUIRE(deserialized.size() == len);
+            for (size_t i=0; i < len; i++) {
+                REQUIRE(deserialized.get(i) == values[i]);
+            }
+        }
+    }
+}
@@ -10,8 +10,11 @@
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
 
+#include <cstdio>
+#include <fstream>
 #include <sstream>
 #include <iostream>
+#include <thread>
 
 namespace collection {
     using namespace puffinn;
@@ -196,6 +199,127 @@ namespace collection {
         test_angular_search_pq();
     }
 
+    TEST_CASE("Index::search pq fast-scan") {
+        int n = 2000;
+        int dimensions = 64;
+        unsigned int k = 10;
+        const int NUM_SAMPLES = 50;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dimensions, 100*MB, true);
+        index.set_pq_fast_scan(true);
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dimensions));
+            index.insert(inserted.back());
+        }
+        index.rebuild();
+
+        int num_correct = 0;
+        for (int sample=0; sample < NUM_SAMPLES; sample++) {
+            // Queries close to inserted values have neighbors well above the estimation error.
+            auto query = inserted[sample];
+            query[0] += 0.1;
+            auto exact = index.search_bf(query, k);
+            auto res = index.search(query, k, 0.5, FilterType::PQ_Simple);
+            REQUIRE(res.size() == k);
+            for (auto i : exact) {
+                num_correct += std::count(res.begin(), res.end(), i);
+            }
+            REQUIRE(std::count(res.begin(), res.end(), sample) == 1);
+        }
+        // The filter is lossy even without fast-scan, so only fail if the recall is far too low.
+        REQUIRE(num_correct >= 0.5*0.5*k*NUM_SAMPLES);
+
+        // The codes stored in the tables follow the values when the index is compacted.
+        for (int i=0; i < NUM_SAMPLES; i += 2) {
+            index.remove(i);
+        }
+        index.compact();
+        for (int sample=1; sample < NUM_SAMPLES; sample += 2) {
+            auto query = inserted[sample];
+            query[0] += 0.1;
+            auto res = index.search(query, k, 0.5, FilterType::PQ_Simple);
+            REQUIRE(std::count(res.begin(), res.end(), sample/2) == 1);
+        }
+    }
+
+    TEST_CASE("Index::search pq filter") {
+        int n = 2000;
+        int dimensions = 64;
+        unsigned int k = 10;
+        float recall = 0.9;
+        const int NUM_SAMPLES = 50;
+
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dimensions));
+        }
+        for (bool fast_scan : {false, true}) {
+            Index<CosineSimilarity, SimHash, SimHash> index(dimensions, 100*MB, true);
+            index.set_pq_fast_scan(fast_scan);
+            for (auto& vec : inserted) {
+                index.insert(vec);
+            }
+            index.rebuild();
+
+            int num_correct = 0;
+            for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                auto query = inserted[sample];
+                query[0] += 0.1;
+                auto exact = index.search_bf(query, k);
+                auto res = index.search(query, k, recall, FilterType::PQ);
+                REQUIRE(res.size() == k);
+                for (auto i : exact) {
+                    num_correct += std::count(res.begin(), res.end(), i);
+                }
+            }
+            // The recall is not guaranteed when filtering with product quantization.
+            REQUIRE(num_correct >= 0.8*recall*k*NUM_SAMPLES);
+        }
+
+        // Indexes without product quantization use the default filter.
+        Index<JaccardSimilarity> set_index(100, 100*MB, false);
+        for (int i=0; i < 500; i++) {
+            set_index.insert(SetFormat::generate_random(100));
+        }
+        set_index.rebuild();
+        REQUIRE(set_index.search(SetFormat::generate_random(100), k, recall, FilterType::PQ).size() == k);
+    }
+
+    TEST_CASE("Index::search pq rerank") {
+        int n = 2000;
+        int dimensions = 64;
+        unsigned int k = 10;
+        float recall = 0.9;
+        const int NUM_SAMPLES = 50;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dimensions, 100*MB, true);
+        index.set_pq_rerank(10);
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dimensions));
+            index.insert(inserted.back());
+        }
+        index.rebuild();
+
+        int num_correct = 0;
+        for (int sample=0; sample < NUM_SAMPLES; sample++) {
+            auto query = inserted[sample];
+            query[0] += 0.1;
+            auto exact = index.search_bf(query, k);
+            auto res = index.search(query, k, recall, FilterType::PQ);
+            REQUIRE(res.size() == k);
+            // The nearest neighbor is easily distinguished from the rest using the codes.
+            REQUIRE(res[0] == static_cast<uint32_t>(sample));
+            for (auto i : exact) {
+                num_correct += std::count(res.begin(), res.end(), i);
+            }
+        }
+        // Candidates that are not among the best estimates are compared after the search,
+        // so the recall is the same as without re-ranking.
+        REQUIRE(num_correct >= 0.8*recall*k*NUM_SAMPLES);
+    }
+
     TEST_CASE("Index::search - 1 value") {
         test_angular_search<SimHash, SimHash>(1, 5);
     }
@@ -233,6 +357,14 @@ namespace collection {
         }
     }
 
+    TEST_CASE("Index::search fht simhash sketches") {
+        std::vector<int> dimensions = {5, 100};
+
+        for (auto d : dimensions) {
+            test_angular_search<FHTCrossPolytopeHash, FHTSimHash>(500, d);
+        }
+    }
+
     void test_jaccard_search(
         int n,
         int dimensions,
@@ -387,6 +519,10 @@ namespace collection {
             100,
             HashPoolArgs<CrossPolytopeHash>(3000),
             HashPoolArgs<SimHash>(1000));
+        test_serialize<CosineSimilarity>(
+            100,
+            IndependentHashArgs<SimHash>(),
+            IndependentHashArgs<FHTSimHash>());
         test_serialize<JaccardSimilarity>(
             1000,
             TensoredHashArgs<MinHash>(),
@@ -437,6 +573,47 @@ namespace collection {
         REQUIRE(s1.str() == s2.str());
     }
 
+    TEST_CASE("Serialize mapped file") {
+        int dims = 100;
+        const char* path = "puffinn_mapped_index.bin";
+        for (bool compressed : {false, true}) {
+            Index<CosineSimilarity, SimHash> index(dims, 20*MB, false);
+            index.set_compressed_tables(compressed);
+            for (int i=0; i < 1000; i++) {
+                index.insert(UnitVectorFormat::generate_random(dims));
+            }
+            index.rebuild();
+            {
+                std::ofstream out(path, std::ios::binary);
+                index.serialize(out);
+            }
+
+            Index<CosineSimilarity, SimHash> mapped(path);
+            std::stringstream s1, s2;
+            index.serialize(s1);
+            mapped.serialize(s2);
+            REQUIRE(s1.str() == s2.str());
+            for (int i=0; i < 10; i++) {
+                auto query = UnitVectorFormat::generate_random(dims);
+                REQUIRE(mapped.search(query, 10, 0.8) == index.search(query, 10, 0.8));
+            }
+
+            // The mapped index can still be modified.
+            auto vec = UnitVectorFormat::generate_random(dims);
+            mapped.insert(vec);
+            mapped.rebuild();
+            auto res = mapped.search(vec, 1, 0.9);
+            REQUIRE(res.size() == 1);
+            REQUIRE(res[0] == 1000);
+        }
+        std::remove(path);
+    }
+
+    TEST_CASE("Deserialize invalid data") {
+        std::stringstream s("not an index");
+        REQUIRE_THROWS_AS(Index<CosineSimilarity>(s), std::invalid_argument);
+    }
+
     TEST_CASE("search_from_index == search") {
         int dims = 100;
         int n = 5000;
@@ -457,4 +634,385 @@ namespace collection {
         res2.pop_back();
         REQUIRE(res1 == res2);
     }
+
+    TEST_CASE("Index::search concurrent") {
+        int dims = 50;
+        int n = 2000;
+        unsigned int k = 10;
+        float recall = 0.8;
+        const int NUM_THREADS = 4;
+        const int QUERIES_PER_THREAD = 25;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dims, 100*MB, true);
+        for (int i=0; i < n; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        std::vector<std::vector<float>> queries;
+        for (int i=0; i < NUM_THREADS*QUERIES_PER_THREAD; i++) {
+            queries.push_back(UnitVectorFormat::generate_random(dims));
+        }
+
+        for (auto filter_type : {FilterType::Default, FilterType::PQ_Simple, FilterType::PQ}) {
+            std::vector<std::vector<uint32_t>> expected;
+            for (auto& q : queries) {
+                expected.push_back(index.search(q, k, recall, filter_type));
+            }
+
+            std::vector<std::vector<uint32_t>> results(queries.size());
+            std::vector<std::thread> threads;
+            for (int t=0; t < NUM_THREADS; t++) {
+                threads.emplace_back([&, t]() {
+                    Index<CosineSimilarity, SimHash, SimHash>::SearchContext ctx;
+                    for (int i=t; i < NUM_THREADS*QUERIES_PER_THREAD; i += NUM_THREADS) {
+                        results[i] = index.search(queries[i], k, recall, ctx, filter_type);
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            REQUIRE(results == expected);
+        }
+    }
+
+    TEST_CASE("Index::search_batch") {
+        int dims = 50;
+        int n = 2000;
+        unsigned int k = 10;
+        float recall = 0.8;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dims, 100*MB, false);
+        for (int i=0; i < n; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        std::vector<std::vector<float>> queries;
+        Dataset<UnitVectorFormat> stored_queries(dims);
+        for (int i=0; i < 100; i++) {
+            queries.push_back(UnitVectorFormat::generate_random(dims));
+            stored_queries.insert(queries.back());
+        }
+
+        std::vector<std::vector<uint32_t>> expected;
+        for (auto& q : queries) {
+            expected.push_back(index.search(q, k, recall));
+        }
+        REQUIRE(index.search_batch(queries, k, recall) == expected);
+        REQUIRE(index.search_batch(stored_queries, k, recall) == expected);
+        REQUIRE(index.search_batch(std::vector<std::vector<float>>(), k, recall).empty());
+
+        std::vector<std::vector<float>> wrong_dimensions = {UnitVectorFormat::generate_random(dims+1)};
+        REQUIRE_THROWS(index.search_batch(wrong_dimensions, k, recall));
+    }
+
+    void test_knn_graph(int n, FilterType filter_type) {
+        int dims = 20;
+        unsigned int k = 5;
+        float recall = 0.9;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dims, 100*MB, false);
+        for (int i=0; i < n; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        auto graph = index.knn_graph(k, recall, filter_type);
+        REQUIRE(graph.offsets.size() == static_cast<size_t>(n+1));
+        REQUIRE(graph.offsets[0] == 0);
+        REQUIRE(graph.offsets[n] == graph.neighbors.size());
+
+        int num_correct = 0;
+        for (int i=0; i < n; i++) {
+            std::vector<uint32_t> neighbors(
+                graph.neighbors.begin()+graph.offsets[i],
+                graph.neighbors.begin()+graph.offsets[i+1]);
+            REQUIRE(neighbors.size() == k);
+            REQUIRE(std::count(neighbors.begin(), neighbors.end(), i) == 0);
+
+            auto exact = index.search_bf(index.get<std::vector<float>>(i), k+1);
+            for (auto j : exact) {
+                if (j != static_cast<uint32_t>(i)) {
+                    num_correct += std::count(neighbors.begin(), neighbors.end(), j);
+                }
+            }
+        }
+        REQUIRE(num_correct >= 0.8*recall*k*n);
+    }
+
+    TEST_CASE("Index::knn_graph") {
+        test_knn_graph(50, FilterType::Default);
+        test_knn_graph(2000, FilterType::Default);
+        test_knn_graph(2000, FilterType::None);
+    }
+
+    TEST_CASE("Index::remove") {
+        int dims = 20;
+        uint32_t n = 2000;
+        unsigned int k = 10;
+        Index<CosineSimilarity, SimHash> index(dims, 10*MB, false);
+        std::vector<std::vector<float>> inserted;
+        for (uint32_t i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dims));
+            index.insert(inserted.back());
+        }
+        index.rebuild();
+        REQUIRE_THROWS_AS(index.remove(n), std::invalid_argument);
+        for (uint32_t i=0; i < n; i += 3) {
+            index.remove(i);
+        }
+        REQUIRE(index.is_removed(0));
+        REQUIRE(!index.is_removed(1));
+
+        for (auto filter_type : {FilterType::Default, FilterType::None, FilterType::Simple}) {
+            for (int sample=0; sample < 20; sample++) {
+                // Queries close to removed values.
+                auto res = index.search(inserted[3*sample], k, 0.9, filter_type);
+                REQUIRE(res.size() == k);
+                for (auto idx : res) {
+                    REQUIRE(!index.is_removed(idx));
+                }
+            }
+        }
+        for (auto idx : index.search_bf(inserted[0], k)) {
+            REQUIRE(!index.is_removed(idx));
+        }
+        auto graph = index.knn_graph(k, 0.9);
+        for (uint32_t idx=0; idx < n; idx++) {
+            REQUIRE((graph.offsets[idx+1] == graph.offsets[idx]) == index.is_removed(idx));
+        }
+        for (auto idx : graph.neighbors) {
+            REQUIRE(!index.is_removed(idx));
+        }
+
+        std::stringstream s;
+        index.serialize(s);
+        Index<CosineSimilarity, SimHash> deserialized(s);
+        REQUIRE(deserialized.is_removed(3));
+        REQUIRE(!deserialized.is_removed(4));
+
+        // Values inserted after the last rebuild are also compacted.
+        auto extra = UnitVectorFormat::generate_random(dims);
+        index.insert(inserted[1]);
+        index.insert(extra);
+        index.remove(n);
+        index.compact();
+        uint32_t remaining = n-(n+2)/3+1;
+        REQUIRE(index.get_size() == remaining);
+        for (uint32_t i=0; i < remaining; i++) {
+            REQUIRE(!index.is_removed(i));
+        }
+        // The new index of a value is its old index minus the number of removed values before it.
+        REQUIRE(index.get<std::vector<float>>(0) == deserialized.get<std::vector<float>>(1));
+        REQUIRE(index.get<std::vector<float>>(1) == deserialized.get<std::vector<float>>(2));
+        REQUIRE(index.get<std::vector<float>>(2) == deserialized.get<std::vector<float>>(4));
+
+        int num_correct = 0;
+        for (int sample=0; sample < 50; sample++) {
+            auto query = UnitVectorFormat::generate_random(dims);
+            auto exact = index.search_bf(query, k);
+            auto res = index.search(query, k, 0.9);
+            REQUIRE(res.size() == k);
+            for (auto idx : res) {
+                REQUIRE(idx < remaining);
+            }
+            for (auto idx : exact) {
+                num_correct += std::count(res.begin(), res.end(), idx);
+            }
+        }
+        REQUIRE(num_correct >= 0.8*0.9*k*50);
+
+        // The value inserted after the last rebuild is still found after rebuilding.
+        index.rebuild();
+        auto res = index.search(extra, 1, 0.9);
+        REQUIRE(res.size() == 1);
+        REQUIRE(res[0] == remaining-1);
+    }
+
+    TEST_CASE("Index::search unindexed values") {
+        int dims = 20;
+        uint32_t n = 2000;
+        Index<CosineSimilarity, SimHash> index(dims, 10*MB, false);
+        std::vector<std::vector<float>> inserted;
+        // Queries are close to, but not equal to, an inserted value.
+        // The expected result is computed by brute force, since rounding in the
+        // fixed point format can make another value the most similar.
+        auto near = [&](uint32_t idx) {
+            auto query = inserted[idx];
+            query[0] += 0.05;
+            return query;
+        };
+        for (uint32_t i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dims));
+            index.insert(inserted.back());
+        }
+        // Values can be found before the first rebuild.
+        REQUIRE(index.search(near(n-1), 1, 0.9) == index.search_bf(near(n-1), 1));
+        index.rebuild();
+        index.set_rebuild_threshold(100);
+
+        for (uint32_t i=n; i < n+250; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dims));
+            index.insert(inserted.back());
+            auto expected = index.search_bf(near(i), 1);
+            for (auto filter_type : {FilterType::Default, FilterType::None, FilterType::Simple}) {
+                REQUIRE(index.search(near(i), 1, 0.9, filter_type) == expected);
+            }
+        }
+        index.remove(n+249);
+        REQUIRE(index.search(near(n+249), 1, 0.9)[0] != n+249);
+        // The index is rebuilt after every 100 inserted values.
+        auto graph = index.knn_graph(1, 0.9);
+        REQUIRE(graph.offsets.size() == n+200+1);
+    }
+
+    TEST_CASE("Index::search compressed tables") {
+        int dims = 50;
+        int n = 3000;
+        unsigned int k = 10;
+        float recall = 0.8;
+        int samples = 100;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dims, 20*MB, false);
+        Index<CosineSimilarity, SimHash, SimHash> uncompressed(dims, 20*MB, false);
+        index.set_compressed_tables(true);
+        for (int i=0; i < n; i++) {
+            auto vec = UnitVectorFormat::generate_random(dims);
+            index.insert(vec);
+            uncompressed.insert(vec);
+        }
+        index.rebuild();
+        uncompressed.rebuild();
+        REQUIRE(index.get_repetitions() > uncompressed.get_repetitions());
+
+        for (auto filter_type : {FilterType::Default, FilterType::None, FilterType::Simple}) {
+            int num_correct = 0;
+            float expected_correct = recall*k*samples;
+            for (int sample=0; sample < samples; sample++) {
+                auto query = UnitVectorFormat::generate_random(dims);
+                auto exact = index.search_bf(query, k);
+                auto res = index.search(query, k, recall, filter_type);
+                REQUIRE(res.size() == k);
+                for (auto i : exact) {
+                    if (std::count(res.begin(), res.end(), i) != 0) {
+                        num_correct++;
+                    }
+                }
+            }
+            REQUIRE(num_correct >= 0.8*expected_correct);
+        }
+
+        std::stringstream s1;
+        index.serialize(s1);
+        Index<CosineSimilarity, SimHash, SimHash> deserialized(s1);
+        auto query = UnitVectorFormat::generate_random(dims);
+        REQUIRE(deserialized.search(query, k, recall) == index.search(query, k, recall));
+    }
+
+    TEST_CASE("Index::search table sketches") {
+        int dims = 50;
+        int n = 3000;
+        unsigned int k = 10;
+        float recall = 0.8;
+        int samples = 100;
+
+        Index<CosineSimilarity, SimHash, SimHash> index(dims, 20*MB, false);
+        Index<CosineSimilarity, SimHash, SimHash> without_sketches(dims, 20*MB, false);
+        index.set_table_sketches(true);
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < n; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(dims));
+            index.insert(inserted.back());
+            without_sketches.insert(inserted.back());
+        }
+        index.rebuild();
+        without_sketches.rebuild();
+        REQUIRE(index.get_repetitions() < without_sketches.get_repetitions());
+
+        // Removed values are also removed from the sketches of each table.
+        for (int i=0; i < n; i += 2) {
+            index.remove(i);
+        }
+        index.compact();
+        for (int i=n/2; i < n; i++) {
+            index.insert(inserted[i]);
+        }
+        index.rebuild();
+
+        int num_correct = 0;
+        float expected_correct = recall*k*samples;
+        for (int sample=0; sample < samples; sample++) {
+            auto query = UnitVectorFormat::generate_random(dims);
+            auto exact = index.search_bf(query, k);
+            auto res = index.search(query, k, recall);
+            REQUIRE(res.size() == k);
+            for (auto i : exact) {
+                if (std::count(res.begin(), res.end(), i) != 0) {
+                    num_correct++;
+                }
+            }
+        }
+        REQUIRE(num_correct >= 0.8*expected_correct);
+
+        std::stringstream s1;
+        index.serialize(s1);
+        Index<CosineSimilarity, SimHash, SimHash> deserialized(s1);
+        auto query = UnitVectorFormat::generate_random(dims);
+        REQUIRE(deserialized.search(query, k, recall) == index.search(query, k, recall));
+    }
+
+    TEST_CASE("Index::search small sketches") {
+        int dims = 50;
+        int n = 3000;
+        unsigned int k = 10;
+        float recall = 0.8;
+        int samples = 100;
+        using SmallSketches = SketchParams<uint16_t, 8>;
+
+        Index<CosineSimilarity, SimHash, SimHash, SmallSketches> index(dims, 20*MB, false);
+        Index<CosineSimilarity, SimHash, SimHash> default_sketches(dims, 20*MB, false);
+        index.set_table_sketches(true);
+        default_sketches.set_table_sketches(true);
+        for (int i=0; i < n; i++) {
+            auto vec = UnitVectorFormat::generate_random(dims);
+            index.insert(vec);
+            default_sketches.insert(vec);
+        }
+        index.rebuild();
+        default_sketches.rebuild();
+        // The sketches use less memory, which is used for more tables.
+        REQUIRE(index.get_repetitions() > default_sketches.get_repetitions());
+
+        for (auto filter_type : {FilterType::Default, FilterType::Simple}) {
+            int num_correct = 0;
+            float expected_correct = recall*k*samples;
+            for (int sample=0; sample < samples; sample++) {
+                auto query = UnitVectorFormat::generate_random(dims);
+                auto exact = index.search_bf(query, k);
+                auto res = index.search(query, k, recall, filter_type);
+                REQUIRE(res.size() == k);
+                for (auto i : exact) {
+                    if (std::count(res.begin(), res.end(), i) != 0) {
+                        num_correct++;
+                    }
+                }
+            }
+            REQUIRE(num_correct >= 0.8*expected_correct);
+        }
+
+        std::stringstream s1;
+        index.serialize(s1);
+        Index<CosineSimilarity, SimHash, SimHash, SmallSketches> deserialized(s1);
+        auto query = UnitVectorFormat::generate_random(dims);
+        REQUIRE(deserialized.search(query, k, recall) == index.search(query, k, recall));
+
+        // The sketches need to have the same parameters when deserializing.
+        std::stringstream s2;
+        index.serialize(s2);
+        REQUIRE_THROWS_AS(
+            (Index<CosineSimilarity, SimHash, SimHash>(s2)),
+            std::invalid_argument);
+    }
 }
@@ -3,9 +3,12 @@
 #include "catch.hpp"
 
 #include "puffinn/dataset.hpp"
+#include "puffinn/format/real_vector.hpp"
+#include "puffinn/format/set.hpp"
 #include "puffinn/format/unit_vector.hpp"
 
 #include <cstring>
+#include <sstream>
 
 namespace dataset {
     using namespace puffinn;
@@ -48,4 +51,65 @@ namespace dataset {
         // Initial vector still there.
         REQUIRE(dataset[0][1] == UnitVectorFormat::to_16bit_fixed_point(1.0));
     }
+
+    TEST_CASE("Serialize set dataset") {
+        const unsigned int UNIVERSE = 100;
+        Dataset<SetFormat> dataset(UNIVERSE);
+        std::vector<std::vector<uint32_t>> sets = { {}, { 5, 1, 99 }, {}, { 0 } };
+        for (auto& set : sets) { dataset.insert(set); }
+
+        std::stringstream s;
+        dataset.serialize(s);
+        Dataset<SetFormat> deserialized(s);
+        REQUIRE(deserialized.get_size() == sets.size());
+        REQUIRE(*deserialized[0] == std::vector<uint32_t>());
+        REQUIRE(*deserialized[1] == std::vector<uint32_t>({ 1, 5, 99 }));
+        REQUIRE(*deserialized[2] == std::vector<uint32_t>());
+        REQUIRE(*deserialized[3] == std::vector<uint32_t>({ 0 }));
+
+        // Can be extended after deserialization.
+        deserialized.insert(std::vector<uint32_t>({ 3 }));
+        REQUIRE(*deserialized[4] == std::vector<uint32_t>({ 3 }));
+    }
+
+    TEST_CASE("Deserialize corrupt set dataset") {
+        const unsigned int UNIVERSE = 100;
+        Dataset<SetFormat> dataset(UNIVERSE);
+        std::vector<std::vector<uint32_t>> sets = { { 5, 1, 99 }, { 0 } };
+        for (auto& set : sets) { dataset.insert(set); }
+
+        std::stringstream s;
+        dataset.serialize(s);
+        auto serialized = s.str();
+        std::stringstream truncated(serialized.substr(0, serialized.size()-sizeof(uint32_t)));
+        REQUIRE_THROWS_AS(Dataset<SetFormat>(truncated), std::invalid_argument);
+
+        // The lengths do not add up to the number of tokens.
+        std::stringstream mismatched;
+        std::vector<uint32_t> lengths = { 3, 2 };
+        std::vector<uint32_t> tokens = { 1, 5, 99, 0 };
+        write_section(mismatched, lengths.data(), lengths.size());
+        write_section(mismatched, tokens.data(), tokens.size());
+        std::vector<uint32_t> values[2];
+        REQUIRE_THROWS_AS(
+            SetFormat::deserialize_values(mismatched, values, 2),
+            std::invalid_argument);
+    }
+
+    TEST_CASE("Serialize real vector dataset") {
+        const unsigned int DIMENSIONS = 3;
+        Dataset<RealVectorFormat> dataset(DIMENSIONS);
+        dataset.insert(std::vector<float>({ 1.5, -2.0, 0.25 }));
+        dataset.insert(std::vector<float>({ 0.0, 3.0, -1.0 }));
+
+        std::stringstream s;
+        dataset.serialize(s);
+        Dataset<RealVectorFormat> deserialized(s);
+        REQUIRE(deserialized.get_size() == 2);
+        for (unsigned int i=0; i < 2; i++) {
+            for (unsigned int d=0; d < DIMENSIONS; d++) {
+                REQUIRE(deserialized[i][d] == dataset[i][d]);
+            }
+        }
+    }
 }
@@ -6,6 +6,8 @@
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/hash/simhash.hpp"
 
+#include <sstream>
+
 using namespace puffinn;
 
 namespace filterer_test {
@@ -67,4 +69,140 @@ namespace filterer_test {
             REQUIRE(bit_counts[bit] != 0);
         }
     }
+
+    TEST_CASE("Filterer with FHTSimHash sketches") {
+        const unsigned int DIMENSIONS = 100;
+        Dataset<UnitVectorFormat> dataset(DIMENSIONS);
+        for (int i=0; i < 20; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+
+        IndependentHashArgs<FHTSimHash> hash_args;
+        Filterer<FHTSimHash> filterer(hash_args, dataset.get_description());
+        filterer.add_sketches(dataset, 0);
+
+        // Every bit of the sketches is used.
+        uint64_t used_bits = 0;
+        for (uint32_t idx=0; idx < dataset.get_size(); idx++) {
+            for (unsigned int sketch=0; sketch < NUM_SKETCHES; sketch++) {
+                used_bits |= filterer.get_sketch(idx, sketch) ^ filterer.get_sketch(0, sketch);
+            }
+        }
+        REQUIRE(used_bits == ~0llu);
+
+        // A value has the same sketches as an identical query.
+        QuerySketches<> sketches;
+        filterer.reset(dataset[3], sketches);
+        sketches.max_sketch_diff = 0;
+        for (size_t i=0; i < NUM_SKETCHES; i++) {
+            REQUIRE(sketches.passes_filter(filterer.get_sketch(3, i), i));
+        }
+        REQUIRE(filterer.get_max_sketch_diff(1.0) == 0);
+    }
+
+    template <typename P>
+    void test_passes_filter4() {
+        using Word = typename P::Word;
+        std::uniform_int_distribution<Word> random_sketch;
+        auto& generator = get_default_random_generator();
+        QuerySketches<P> sketches;
+        for (size_t i=0; i < P::NUM_SKETCHES; i++) {
+            sketches.query_sketches.push_back(random_sketch(generator));
+        }
+        for (int sample=0; sample < 1000; sample++) {
+            sketches.max_sketch_diff = P::BITS*3/8+sample%(P::BITS/4);
+            size_t sketch_idx = sample%P::NUM_SKETCHES;
+            Word s[4];
+            uint32_t values[4];
+            unsigned int expected_mask = 0;
+            std::vector<uint32_t> expected;
+            for (int i=0; i < 4; i++) {
+                s[i] = random_sketch(generator);
+                values[i] = sample*4+i;
+                if (sketches.passes_filter(s[i], sketch_idx)) {
+                    expected_mask |= 1 << i;
+                    expected.push_back(values[i]);
+                }
+            }
+            auto mask = sketches.passes_filter4(s[0], s[1], s[2], s[3], sketch_idx);
+            REQUIRE(mask == expected_mask);
+
+            uint32_t out[4];
+            auto count = append_passing4(out, values, mask);
+            REQUIRE(std::vector<uint32_t>(out, out+count) == expected);
+        }
+    }
+
+    TEST_CASE("passes_filter4 == passes_filter") {
+        test_passes_filter4<SketchParams<>>();
+        test_passes_filter4<SketchParams<uint32_t, 16>>();
+        test_passes_filter4<SketchParams<uint16_t, 8>>();
+    }
+
+    // Compare the sketches of the filterer with hashing each value using its serialized hash functions.
+    template <typename P>
+    void test_sketch_matrix() {
+        const unsigned int DIMENSIONS = 70;
+        Dataset<UnitVectorFormat> dataset(DIMENSIONS);
+        for (int i=0; i < 50; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+
+        IndependentHashArgs<SimHash> hash_args;
+        Filterer<SimHash, P> filterer(hash_args, dataset.get_description());
+        filterer.add_sketches(dataset, 0);
+
+        std::stringstream s;
+        filterer.serialize(s);
+        unsigned int params[2];
+        s.read(reinterpret_cast<char*>(params), sizeof(params));
+        auto source = deserialize_hash_args<SimHash>(s)->deserialize_source(s);
+        std::vector<std::unique_ptr<Hash>> functions;
+        for (size_t i=0; i < P::NUM_SKETCHES; i++) {
+            functions.push_back(source->deserialize_hash(s));
+        }
+
+        QuerySketches<P> sketches;
+        for (uint32_t idx=0; idx < dataset.get_size(); idx++) {
+            auto state = source->reset(dataset[idx], false);
+            filterer.reset(dataset[idx], sketches);
+            for (size_t i=0; i < P::NUM_SKETCHES; i++) {
+                auto expected = static_cast<typename P::Word>((*functions[i])(state.get()));
+                REQUIRE(filterer.get_sketch(idx, i) == expected);
+                REQUIRE(sketches.query_sketches[i] == expected);
+            }
+        }
+    }
+
+    TEST_CASE("Filterer sketch matrix") {
+        test_sketch_matrix<SketchParams<>>();
+        test_sketch_matrix<SketchParams<uint64_t, 8>>();
+        test_sketch_matrix<SketchParams<uint16_t, 8>>();
+    }
+
+    TEST_CASE("Filterer with 16-bit sketches") {
+        const unsigned int DIMENSIONS = 100;
+        Dataset<UnitVectorFormat> dataset(DIMENSIONS);
+        for (int i=0; i < 20; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+
+        IndependentHashArgs<SimHash> hash_args;
+        Filterer<SimHash, SketchParams<uint16_t, 8>> filterer(hash_args, dataset.get_description());
+        filterer.add_sketches(dataset, 0);
+        REQUIRE(filterer.get_max_sketch_diff(1.0) == 0);
+        REQUIRE(filterer.get_max_sketch_diff(0.0) == 16);
+
+        // A value has the same sketches as an identical query.
+        QuerySketches<SketchParams<uint16_t, 8>> sketches;
+        filterer.reset(dataset[3], sketches);
+        sketches.max_sketch_diff = 0;
+        for (size_t i=0; i < 8; i++) {
+            REQUIRE(sketches.passes_filter(filterer.get_sketch(3, i), i));
+        }
+
+        std::stringstream s;
+        filterer.serialize(s);
+        REQUIRE_THROWS_AS(Filterer<SimHash>(s), std::invalid_argument);
+    }
 }
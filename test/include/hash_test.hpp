@@ -65,7 +65,10 @@ namespace hash {
         unsigned int dimensions,
         unsigned int num_samples = 10000,
         unsigned int num_bits = 0,
-        typename T::Args args = typename T::Args()
+        typename T::Args args = typename T::Args(),
+        // Compare the most significant bits of the hashes, which are the ones kept when
+        // a hash is shortened, instead of the least significant bits.
+        bool most_significant_bits = false
     ) {
         const float ACCEPTED_DEVIATION = 0.02;
 
@@ -73,6 +76,8 @@ namespace hash {
 
         auto family = T(dataset.get_description(), args);
         auto hash_bits = num_bits == 0 ? family.bits_per_function() : num_bits;
+        auto shift = most_significant_bits ? family.bits_per_function()-hash_bits : 0;
+        uint64_t mask = most_significant_bits ? ~0ull : (1ull << hash_bits)-1;
 
         float prob_sum = 0;
         float actual_sum = 0;
@@ -85,8 +90,8 @@ namespace hash {
                 vec_a, dataset.get_description());
             auto stored_b = to_stored_type<typename T::Sim::Format>(
                 vec_b, dataset.get_description());
-            auto hash_a = hasher(stored_a.get()) % (1 << hash_bits);
-            auto hash_b = hasher(stored_b.get()) % (1 << hash_bits);
+            auto hash_a = (hasher(stored_a.get()) >> shift) & mask;
+            auto hash_b = (hasher(stored_b.get()) >> shift) & mask;
             auto sim = TSim::compute_similarity(
                 stored_a.get(), stored_b.get(), dataset.get_description());
             float prob = family.collision_probability(sim, hash_bits);
@@ -123,6 +128,23 @@ namespace hash {
         test_hash_collision_probability<FHTCrossPolytopeHash, CosineSimilarity>(100);
     }
 
+    TEST_CASE("FHTSimHash collision probability") {
+        FHTSimHashArgs args;
+        test_hash_collision_probability<FHTSimHash, CosineSimilarity>(100, 10000, 1, args, true);
+        test_hash_collision_probability<FHTSimHash, CosineSimilarity>(100, 10000, 4, args, true);
+        test_hash_collision_probability<FHTSimHash, CosineSimilarity>(3, 10000, 0, args, true);
+
+        // Single bits behave like SimHash.
+        Dataset<UnitVectorFormat> dataset(100);
+        FHTSimHash fht_simhash(dataset.get_description(), FHTSimHashArgs());
+        SimHash simhash(dataset.get_description(), SimHashArgs());
+        for (float sim : {0.1f, 0.5f, 0.9f}) {
+            REQUIRE(std::abs(
+                fht_simhash.collision_probability(sim, 1)-simhash.collision_probability(sim, 1))
+                <= 0.03);
+        }
+    }
+
     TEST_CASE("MinHash collision probability") {
         Dataset<SetFormat> dataset(100);
         MinHash minhash(dataset.get_description(), MinHashArgs());
@@ -150,6 +172,12 @@ namespace hash {
         SimHash simhash = SimHash(dataset.get_description(), SimHashArgs());
         REQUIRE(simhash.bits_per_function() == 1);
 
+        FHTSimHash fht_simhash(dataset.get_description(), FHTSimHashArgs());
+        REQUIRE(fht_simhash.bits_per_function() == 32);
+        Dataset<UnitVectorFormat> small_dataset(10);
+        FHTSimHash small_fht_simhash(small_dataset.get_description(), FHTSimHashArgs());
+        REQUIRE(small_fht_simhash.bits_per_function() == 16);
+
         Dataset<SetFormat> set_dataset(dimensions);
         MinHash minhash = MinHash(set_dataset.get_description(), MinHashArgs());
         REQUIRE(minhash.bits_per_function() == 7);
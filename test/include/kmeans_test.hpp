@@ -162,6 +162,84 @@ namespace kmeans {
         
     }
     
+    TEST_CASE("assignToClusters matches nearest centroid") {
+        const unsigned int N = 1003, dims = 21, K = 13;
+        std::vector<std::vector<float>> data;
+        for (unsigned int i = 0; i < N; i++) {
+            data.push_back(RealVectorFormat::generate_random(dims));
+        }
+        KMeans clustering(K);
+        clustering.padData(data);
+        std::vector<KMeans::Cluster> clusters = clustering.init_centroids_random(data);
+        double inertia = clustering.assignToClusters(data, clusters);
+
+        double expected_inertia = 0;
+        unsigned int num_members = 0;
+        for (unsigned int c_i = 0; c_i < K; c_i++) {
+            for (unsigned int idx : clusters[c_i].members) {
+                double min_dist = DBL_MAX;
+                for (auto &c : clusters) {
+                    min_dist = std::min(min_dist, clustering.sumOfSquares(data[idx], c.centroid));
+                }
+                REQUIRE(clustering.sumOfSquares(data[idx], clusters[c_i].centroid) == Approx(min_dist).margin(1e-4));
+                expected_inertia += min_dist;
+                num_members++;
+            }
+        }
+        REQUIRE(num_members == N);
+        REQUIRE(inertia == Approx(expected_inertia).epsilon(1e-4));
+    }
+
+    TEST_CASE("hamerly iterations match plain iterations") {
+        const unsigned int N = 1000, dims = 16, K = 10, num_blobs = 20;
+        std::vector<std::vector<float>> blobs, data;
+        for (unsigned int b = 0; b < num_blobs; b++) {
+            blobs.push_back(RealVectorFormat::generate_random(dims));
+        }
+        for (unsigned int i = 0; i < N; i++) {
+            std::vector<float> point = RealVectorFormat::generate_random(dims);
+            for (unsigned int d = 0; d < dims; d++) {
+                point[d] = blobs[i%num_blobs][d] + 0.05f*point[d];
+            }
+            data.push_back(point);
+        }
+        KMeans plain(K, KMeans::euclidean, 1, 300, 0.0f, KMeans::plain);
+        KMeans hamerly(K, KMeans::euclidean, 1, 300, 0.0f, KMeans::hamerly);
+        plain.padData(data);
+        std::vector<KMeans::Cluster> plain_clusters = plain.init_centroids_random(data);
+        std::vector<KMeans::Cluster> hamerly_clusters = plain_clusters;
+        double plain_inertia = plain.lloyd(data, plain_clusters, 300);
+        double hamerly_inertia = hamerly.lloyd(data, hamerly_clusters, 300);
+
+        REQUIRE(hamerly_inertia == Approx(plain_inertia).epsilon(1e-4));
+        for (unsigned int c_i = 0; c_i < K; c_i++) {
+            REQUIRE(hamerly_clusters[c_i].members == plain_clusters[c_i].members);
+        }
+    }
+
+    TEST_CASE("kmeans++ never picks a chosen point twice") {
+        const unsigned int K = 6, copies = 700;
+        std::vector<std::vector<float>> distinct, data;
+        for (unsigned int c_i = 0; c_i < K; c_i++) {
+            distinct.push_back(RealVectorFormat::generate_random(5));
+        }
+        // Spread the copies over several blocks of the sampler
+        for (unsigned int i = 0; i < K*copies; i++) {
+            data.push_back(distinct[i%K]);
+        }
+        KMeans clustering(K);
+        clustering.padData(data);
+        clustering.padData(distinct);
+        for (unsigned int run = 0; run < 20; run++) {
+            std::vector<KMeans::Cluster> clusters = clustering.init_centroids_kpp(data);
+            std::set<std::vector<float>> chosen;
+            for (auto &c : clusters) {
+                chosen.insert(c.centroid);
+            }
+            REQUIRE(chosen == std::set<std::vector<float>>(distinct.begin(), distinct.end()));
+        }
+    }
+
     TEST_CASE("basic kmeans clustering 3") {
 
         struct TestData td;
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "catch.hpp"
+#include "puffinn/mmap.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace mmap_test {
+    using namespace puffinn;
+
+    TEST_CASE("read_section from mapped file") {
+        const char* path = "puffinn_mapped_section.bin";
+        std::vector<uint64_t> values;
+        for (uint64_t i=0; i < 1000; i++) {
+            values.push_back(i*i);
+        }
+        {
+            std::ofstream out(path, std::ios::binary);
+            // Misalign the section to test that padding is added.
+            char c = 'x';
+            out.write(&c, 1);
+            write_section(out, values.data(), values.size());
+            write_section(out, values.data(), 0);
+        }
+
+        MappableArray<uint64_t> arr, empty;
+        {
+            MappedInputStream in(path);
+            char c;
+            in.read(&c, 1);
+            read_section(in, arr);
+            read_section(in, empty);
+            REQUIRE(in.good());
+        }
+        // The mapping outlives the stream.
+        REQUIRE(arr.is_mapped());
+        REQUIRE(reinterpret_cast<uintptr_t>(arr.data())%SECTION_ALIGNMENT == 0);
+        REQUIRE(std::vector<uint64_t>(arr.begin(), arr.end()) == values);
+        REQUIRE(empty.size() == 0);
+
+        MappableArray<uint64_t> copy = arr;
+        REQUIRE(!copy.is_mapped());
+        copy[0] = 5;
+        REQUIRE(arr[0] == 0);
+        arr.resize(2000);
+        REQUIRE(!arr.is_mapped());
+        REQUIRE(arr[1] == 1);
+        REQUIRE(arr[1999] == 0);
+        std::remove(path);
+
+        // Streams that are not mapped are copied.
+        std::stringstream s;
+        write_section(s, values.data(), values.size());
+        MappableArray<uint64_t> read;
+        read_section(s, read);
+        REQUIRE(!read.is_mapped());
+        REQUIRE(std::vector<uint64_t>(read.begin(), read.end()) == values);
+    }
+}
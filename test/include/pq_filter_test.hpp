@@ -155,7 +155,128 @@ namespace pq{
         REQUIRE(isSame);
         
     }
-    
 
+    TEST_CASE("PQFilter fast-scan estimates") {
+        unsigned int N = 300, dims = 64, m = 8;
+        Dataset<UnitVectorFormat> dataset(dims, N);
+        for(unsigned int i = 0; i < N; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        PQFilter pq1(dataset, m, PQ_FAST_SCAN_CENTROIDS);
+        pq1.rebuild();
+        REQUIRE(pq1.fastScanEnabled());
+
+        auto query = to_stored_type<UnitVectorFormat>(
+            UnitVectorFormat::generate_random(dims), dataset.get_description());
+        std::vector<int16_t> distances(pq1.getLookupTableSize());
+        PQFastScanTable table;
+        pq1.precompFastScanTable(query.get(), distances.data(), table);
+        std::vector<int16_t> expected(pq1.getLookupTableSize());
+        pq1.precomp_query_to_centroids(query.get(), expected.data());
+        REQUIRE(distances == expected);
+
+        //Each quantized entry is off by at most half a step
+        float maxError = m*table.scale/2+1;
+        for(unsigned int b = 0; b*PQ_FAST_SCAN_BLOCK < N; b++){
+            uint32_t indices[PQ_FAST_SCAN_BLOCK];
+            unsigned int n = std::min(PQ_FAST_SCAN_BLOCK, N-b*PQ_FAST_SCAN_BLOCK);
+            std::vector<uint8_t> block(pq1.getFastScanBlockSize(), 0);
+            for(unsigned int j = 0; j < n; j++){
+                indices[j] = N-1-(b*PQ_FAST_SCAN_BLOCK+j);
+                pq1.packFastScanCode(block.data(), j, pq1.getCode(indices[j]));
+            }
+            int16_t estimates[PQ_FAST_SCAN_BLOCK];
+            pq1.estimatedInnerProducts(table, block.data(), estimates);
+
+            for(unsigned int j = 0; j < n; j++){
+                REQUIRE(std::abs(estimates[j]-pq1.estimatedInnerProduct(distances.data(), indices[j])) <= maxError);
+            }
+        }
+    }
+
+    TEST_CASE("PQFilter rebuild and compact codes") {
+        unsigned int N = 300, dims = 64, m = 4, k = 32;
+        Dataset<UnitVectorFormat> dataset(dims, N);
+        for(unsigned int i = 0; i < N/2; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        PQFilter pq1(dataset, m, k);
+        pq1.rebuild();
+        for(unsigned int i = N/2; i < N; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        pq1.rebuild();
+        //Rebuilding replaces the previous codebook instead of adding to it
+        PQFilter pq2(dataset, m, k);
+        pq2.rebuild();
+        REQUIRE(pq1.memory_usage() == pq2.memory_usage());
+
+        std::vector<std::vector<uint8_t>> codes;
+        for(unsigned int i = 0; i < N; i++){
+            codes.emplace_back(pq1.getCode(i), pq1.getCode(i)+m);
+        }
+        std::vector<uint32_t> new_indices;
+        uint32_t remaining = 0;
+        for(unsigned int i = 0; i < N; i++){
+            new_indices.push_back(i%3 == 0 ? REMOVED_INDEX : remaining++);
+        }
+        dataset.compact(new_indices);
+        pq1.compact(new_indices);
+        for(unsigned int i = 0; i < N; i++){
+            if (new_indices[i] == REMOVED_INDEX) continue;
+            REQUIRE(std::vector<uint8_t>(pq1.getCode(new_indices[i]), pq1.getCode(new_indices[i])+m) == codes[i]);
+        }
+    }
+
+    TEST_CASE("PQFilter update keeps the codebook") {
+        unsigned int N = 400, dims = 64, m = 4, k = 16;
+        Dataset<UnitVectorFormat> dataset(dims, N);
+        for(unsigned int i = 0; i < N/2; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        PQFilter pq1(dataset, m, k);
+        pq1.rebuild();
+        auto query = UnitVectorFormat::generate_random(dims);
+        auto query_stored = to_stored_type<UnitVectorFormat>(query, dataset.get_description());
+        std::vector<int16_t> before(m*k), after(m*k);
+        pq1.precomp_query_to_centroids(query_stored.get(), before.data());
+
+        for(unsigned int i = N/2; i < N/2+N/4; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        pq1.update();
+        pq1.precomp_query_to_centroids(query_stored.get(), after.data());
+        REQUIRE(before == after);
+        //The new points are encoded with their nearest centroid
+        for(unsigned int i = 0; i < N/2+N/4; i++){
+            REQUIRE(pq1.quantizationError(i) <= pq1.quantizationError_simple(i) + 1e-4f);
+        }
+
+        //The codebook is retrained once the dataset has doubled since it was trained
+        for(unsigned int i = N/2+N/4; i < N; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        pq1.update();
+        pq1.precomp_query_to_centroids(query_stored.get(), after.data());
+        REQUIRE(before != after);
+    }
 
+    TEST_CASE("PQFilter trained on a sample") {
+        unsigned int N = 5000, dims = 32, m = 4, k = 16;
+        Dataset<UnitVectorFormat> dataset(dims, N);
+        for(unsigned int i = 0; i < N; i++){
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        PQFilter sampled(dataset, m, k);
+        sampled.setTrainingSampleSize(500);
+        sampled.rebuild();
+        //Points outside of the sample are also encoded with their nearest centroid
+        for(unsigned int i = 0; i < N; i++){
+            REQUIRE(sampled.quantizationError(i) <= sampled.quantizationError_simple(i) + 1e-4f);
+        }
+        PQFilter full(dataset, m, k);
+        full.setTrainingSampleSize(0);
+        full.rebuild();
+        REQUIRE(sampled.totalQuantizationError() <= 1.2f*full.totalQuantizationError());
+    }
 }
@@ -1,7 +1,113 @@
 #include "catch.hpp"
 #include "puffinn/prefixmap.hpp"
+#include "puffinn/format/unit_vector.hpp"
+#include "puffinn/hash_source/independent.hpp"
+#include "puffinn/hash/simhash.hpp"
+
+#include <sstream>
 
 using namespace puffinn;
 
 namespace prefixmap {
+    // Insert the vectors in [first, last) of the dataset into the map.
+    void insert_range(
+        PrefixMap<SimHash>& map,
+        HashSource<SimHash>& source,
+        Dataset<UnitVectorFormat>& dataset,
+        uint32_t first,
+        uint32_t last
+    ) {
+        for (uint32_t idx=first; idx < last; idx++) {
+            auto state = source.reset(dataset[idx], false);
+            map.insert(idx, state.get());
+        }
+    }
+
+    TEST_CASE("PrefixMap incremental rebuild") {
+        const unsigned int DIMENSIONS = 20;
+        const uint32_t SIZE = 3000;
+        Dataset<UnitVectorFormat> dataset(DIMENSIONS, SIZE);
+        for (uint32_t i=0; i < SIZE; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        auto source = IndependentHashArgs<SimHash>().build(
+            dataset.get_description(), 2, MAX_HASHBITS);
+
+        for (bool compressed : {false, true}) {
+            PrefixMap<SimHash> map(source->sample(), MAX_HASHBITS);
+            map.set_compressed(compressed);
+            // Rebuild several times with a varying number of new values.
+            insert_range(map, *source, dataset, 0, 1000);
+            map.rebuild();
+            insert_range(map, *source, dataset, 1000, 1010);
+            map.rebuild();
+            map.rebuild();
+            insert_range(map, *source, dataset, 1010, SIZE);
+            map.rebuild();
+            REQUIRE(map.stored_size() == SIZE);
+
+            std::vector<uint32_t> positions(SIZE, 0);
+            map.find_positions(0, SIZE, &positions[0], 1);
+            std::vector<std::pair<uint32_t, uint32_t>> by_position;
+            for (uint32_t idx=0; idx < SIZE; idx++) {
+                // Each value is stored with its own hash.
+                auto state = source->reset(dataset[idx], false);
+                REQUIRE(map.create_query(state.get()).hash == map.create_query_at(positions[idx]).hash);
+                by_position.push_back({ positions[idx], idx });
+            }
+            // Every value is stored once, sorted by hash.
+            std::sort(by_position.begin(), by_position.end());
+            for (uint32_t i=1; i < SIZE; i++) {
+                REQUIRE(by_position[i].first == by_position[i-1].first+1);
+                REQUIRE(
+                    map.create_query_at(by_position[i-1].first).hash
+                    <= map.create_query_at(by_position[i].first).hash);
+            }
+        }
+    }
+
+    TEST_CASE("PrefixMap prefix index bits") {
+        const unsigned int DIMENSIONS = 20;
+        const uint32_t SIZE = 3000;
+        Dataset<UnitVectorFormat> dataset(DIMENSIONS, SIZE);
+        for (uint32_t i=0; i < SIZE; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        auto source = IndependentHashArgs<SimHash>().build(
+            dataset.get_description(), 2, MAX_HASHBITS);
+
+        if (PUFFINN_PREFIX_INDEX_BITS == 0) {
+            // Each indexed prefix holds at most PREFIX_INDEX_BUCKET_SIZE values on average,
+            // using as few bits as possible.
+            REQUIRE(PrefixMap<SimHash>::choose_prefix_index_bits(0, MAX_HASHBITS) == 1);
+            for (size_t size : {10, 100, 3000, 1000000}) {
+                auto bits = PrefixMap<SimHash>::choose_prefix_index_bits(size, MAX_HASHBITS);
+                REQUIRE((size >> bits) <= 8);
+                REQUIRE((size >> (bits-1)) > 8);
+            }
+            REQUIRE(PrefixMap<SimHash>::choose_prefix_index_bits(1000000, 4) == 4);
+        }
+
+        for (bool compressed : {false, true}) {
+            PrefixMap<SimHash> map(source->sample(), MAX_HASHBITS);
+            map.set_compressed(compressed);
+            insert_range(map, *source, dataset, 0, SIZE);
+            map.rebuild();
+            REQUIRE(map.get_prefix_index_bits() ==
+                PrefixMap<SimHash>::choose_prefix_index_bits(SIZE, MAX_HASHBITS));
+
+            // The chosen bits and the index survive serialization.
+            std::stringstream stream;
+            map.serialize(stream);
+            PrefixMap<SimHash> deserialized(stream, *source);
+            REQUIRE(deserialized.get_prefix_index_bits() == map.get_prefix_index_bits());
+            for (uint32_t idx=0; idx < SIZE; idx += 7) {
+                auto state = source->reset(dataset[idx], false);
+                auto query = map.create_query(state.get());
+                auto deserialized_query = deserialized.create_query(state.get());
+                REQUIRE(query.hash == deserialized_query.hash);
+                REQUIRE(query.prefix_start == deserialized_query.prefix_start);
+            }
+        }
+    }
 }